@@ -0,0 +1,108 @@
+/*
+ * Submission through the mmap ring against plain write().
+ *
+ * Both modes push the same amount of comma filled data in chunks of the
+ * given size. The ring producer fills as much as fits, publishes head and
+ * kicks the driver only when the ring is full.
+ *
+ * Usage: ./ring [chunk_bytes] [total_megabytes] [ring_kilobytes]
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../io_lab.h"
+
+static const char *dev_path = "/dev/io_lab";
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_write(const char *chunk, size_t len, size_t total)
+{
+    int fd = open(dev_path, O_WRONLY);
+    size_t done;
+    double t0;
+
+    if (fd < 0) {
+        perror(dev_path);
+        exit(1);
+    }
+    t0 = now();
+    for (done = 0; done < total; done += len) {
+        if (write(fd, chunk, len) != (ssize_t)len) {
+            perror("write");
+            exit(1);
+        }
+    }
+    printf("%-6s %8.2f GB/s\n", "write", total / (now() - t0) / 1e9);
+    close(fd);
+}
+
+static void bench_ring(const char *chunk, size_t len, size_t total, size_t ring_size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    int fd = open(dev_path, O_RDWR);
+    struct io_lab_ring *ring;
+    char *data;
+    __u32 head = 0;
+    size_t done, kicks = 0;
+    double t0;
+
+    if (fd < 0) {
+        perror(dev_path);
+        exit(1);
+    }
+    ring = mmap(NULL, page + ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    data = (char *)ring + page;
+
+    t0 = now();
+    for (done = 0; done < total; done += len) {
+        size_t pos = head & (ring_size - 1);
+        size_t first = len < ring_size - pos ? len : ring_size - pos;
+
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) + len > ring_size) {
+            ioctl(fd, IO_LAB_RING_KICK);
+            kicks++;
+        }
+        memcpy(data + pos, chunk, first);
+        memcpy(data, chunk + first, len - first);
+        head += len;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    ioctl(fd, IO_LAB_RING_KICK);
+    printf("%-6s %8.2f GB/s, %zu kicks\n", "ring", total / (now() - t0) / 1e9, kicks + 1);
+    munmap(ring, page + ring_size);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? strtoull(argv[1], NULL, 0) : 256;
+    size_t total = (argc > 2 ? strtoull(argv[2], NULL, 0) : 256) << 20;
+    size_t ring_size = (argc > 3 ? strtoull(argv[3], NULL, 0) : 1024) << 10;
+    char *chunk = malloc(len);
+
+    if (len > ring_size) {
+        fprintf(stderr, "chunk does not fit into the ring\n");
+        return 1;
+    }
+    memset(chunk, ',', len);
+    bench_write(chunk, len, total);
+    bench_ring(chunk, len, total, ring_size);
+    free(chunk);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Throughput of the comma counting kernels from coma_scan.h.
+ *
+ * Usage: ./scan [buffer_bytes] [total_megabytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../coma_scan.h"
+
+typedef size_t (*scan_fn)(const unsigned char *, size_t, unsigned char);
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, scan_fn fn, const unsigned char *buf,
+                size_t len, size_t total, size_t expect)
+{
+    size_t iters = total / len ? total / len : 1;
+    volatile size_t sink = 0;
+    double t0, t1;
+    size_t i;
+
+    if (fn(buf, len, ',') != expect) {
+        printf("%-8s wrong result\n", name);
+        return;
+    }
+    t0 = now();
+    for (i = 0; i < iters; i++)
+        sink += fn(buf, len, ',');
+    t1 = now();
+    printf("%-8s %8.2f GB/s\n", name, (double)iters * len / (t1 - t0) / 1e9);
+}
+
+/* full 256 bin histogram, the driver runs it on every write */
+static void run_hist(const unsigned char *buf, size_t len, size_t total)
+{
+    size_t iters = total / len ? total / len : 1;
+    static uint64_t bins[256];
+    unsigned char weight[256];
+    double t0, t1;
+    size_t i;
+
+    memset(weight, 1, sizeof(weight));
+    t0 = now();
+    for (i = 0; i < iters; i++)
+        coma_hist(buf, len, bins, weight);
+    t1 = now();
+    printf("%-8s %8.2f GB/s\n", "hist", (double)iters * len / (t1 - t0) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? strtoull(argv[1], NULL, 0) : 256;
+    size_t total = (argc > 2 ? strtoull(argv[2], NULL, 0) : 1024) << 20;
+    unsigned char *buf = malloc(len);
+    size_t i, expect;
+
+    srand(1);
+    for (i = 0; i < len; i++)
+        buf[i] = rand() % 8 ? 'a' + rand() % 26 : ',';
+    expect = coma_scan_bytes(buf, len, ',');
+
+    printf("buffer %zu bytes, %zu commas\n", len, expect);
+    run("bytes", coma_scan_bytes, buf, len, total, expect);
+    run("swar", coma_scan_swar, buf, len, total, expect);
+#ifdef COMA_SCAN_HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        run("sse2", coma_scan_sse2, buf, len, total, expect);
+    if (__builtin_cpu_supports("avx2"))
+        run("avx2", coma_scan_avx2, buf, len, total, expect);
+#endif
+    run_hist(buf, len, total);
+    free(buf);
+    return 0;
+}
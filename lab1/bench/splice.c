@@ -0,0 +1,184 @@
+/*
+ * Feeding a file into /dev/io_lab with write(), writev(), splice() and
+ * sendfile().
+ *
+ * The file is read once beforehand so every mode works from the page cache.
+ * write() and writev() first read the data into user buffers, splice() and
+ * sendfile() move page cache pages to the driver without that copy.
+ *
+ * Usage: ./splice file [chunk_bytes]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IOV_CNT 16
+
+static const char *dev_path = "/dev/io_lab";
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_or_die(const char *path, int flags)
+{
+    int fd = open(path, flags);
+
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void report(const char *name, off_t size, double t0)
+{
+    printf("%-9s %8.2f GB/s\n", name, size / (now() - t0) / 1e9);
+}
+
+static void warm(int in, off_t size, size_t chunk)
+{
+    char *buf = malloc(chunk);
+    off_t pos;
+    ssize_t n;
+
+    for (pos = 0; pos < size && (n = pread(in, buf, chunk, pos)) > 0; pos += n)
+        ;
+    free(buf);
+}
+
+static void bench_write(int in, int out, off_t size, size_t chunk)
+{
+    char *buf = malloc(chunk);
+    double t0 = now();
+    off_t pos;
+    ssize_t n;
+
+    for (pos = 0; pos < size; pos += n) {
+        n = pread(in, buf, chunk, pos);
+        if (n <= 0 || write(out, buf, n) != n) {
+            perror("write");
+            exit(1);
+        }
+    }
+    report("write", size, t0);
+    free(buf);
+}
+
+static void bench_writev(int in, int out, off_t size, size_t chunk)
+{
+    struct iovec iov[IOV_CNT];
+    size_t part = chunk / IOV_CNT;
+    char *buf = malloc(chunk);
+    double t0;
+    off_t pos;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < IOV_CNT; i++) {
+        iov[i].iov_base = buf + i * part;
+        iov[i].iov_len = part;
+    }
+    t0 = now();
+    for (pos = 0; pos < size; pos += n) {
+        n = preadv(in, iov, IOV_CNT, pos);
+        if (n <= 0) {
+            perror("readv");
+            exit(1);
+        }
+        /* the tail of the file fills only a part of the vector */
+        for (i = 0; i < IOV_CNT; i++)
+            iov[i].iov_len = n > (ssize_t)((i + 1) * part) ? part :
+                             n > (ssize_t)(i * part) ? n - i * part : 0;
+        if (writev(out, iov, IOV_CNT) != n) {
+            perror("writev");
+            exit(1);
+        }
+        for (i = 0; i < IOV_CNT; i++)
+            iov[i].iov_len = part;
+    }
+    report("writev", size, t0);
+    free(buf);
+}
+
+static void bench_splice(int in, int out, off_t size, size_t chunk)
+{
+    double t0 = now();
+    loff_t pos = 0;
+    int p[2];
+
+    if (pipe(p) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(p[1], F_SETPIPE_SZ, chunk);
+    while (pos < size) {
+        ssize_t n = splice(in, &pos, p[1], NULL, chunk, SPLICE_F_MOVE);
+
+        if (n <= 0) {
+            perror("splice");
+            exit(1);
+        }
+        while (n > 0) {
+            ssize_t m = splice(p[0], NULL, out, NULL, n, SPLICE_F_MOVE);
+
+            if (m <= 0) {
+                perror("splice");
+                exit(1);
+            }
+            n -= m;
+        }
+    }
+    report("splice", size, t0);
+    close(p[0]);
+    close(p[1]);
+}
+
+static void bench_sendfile(int in, int out, off_t size, size_t chunk)
+{
+    double t0 = now();
+    off_t pos = 0;
+
+    while (pos < size) {
+        if (sendfile(out, in, &pos, chunk) <= 0) {
+            perror("sendfile");
+            exit(1);
+        }
+    }
+    report("sendfile", size, t0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t chunk = argc > 2 ? strtoull(argv[2], NULL, 0) : 1 << 16;
+    struct stat st;
+    int in, out;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file [chunk_bytes]\n", argv[0]);
+        return 1;
+    }
+    in = open_or_die(argv[1], O_RDONLY);
+    out = open_or_die(dev_path, O_WRONLY);
+    fstat(in, &st);
+
+    warm(in, st.st_size, chunk);
+    bench_write(in, out, st.st_size, chunk);
+    bench_writev(in, out, st.st_size, chunk);
+    bench_splice(in, out, st.st_size, chunk);
+    bench_sendfile(in, out, st.st_size, chunk);
+
+    close(out);
+    close(in);
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Parallel writers for /dev/io_lab.
+ *
+ * For every thread count from 1 to N, the threads are pinned to CPUs
+ * 0..n-1 and write a buffer full of commas for a fixed time. Comma rate is
+ * computed from the device counter and checked against the number of
+ * commas actually written, so lost increments show up as "lost".
+ *
+ * Usage: ./writers [max_threads] [seconds] [device]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WBUF_SIZE 256
+
+static const char *dev_path = "/dev/io_lab";
+static atomic_int stop;
+
+struct writer {
+    pthread_t tid;
+    int cpu;
+    unsigned long long commas;
+};
+
+static unsigned long long read_counter(void)
+{
+    char buf[32] = {0};
+    int fd = open(dev_path, O_RDONLY);
+
+    if (fd < 0 || read(fd, buf, sizeof(buf) - 1) <= 0) {
+        perror(dev_path);
+        exit(1);
+    }
+    close(fd);
+    return strtoull(buf, NULL, 10);
+}
+
+static void *writer_fn(void *arg)
+{
+    struct writer *w = arg;
+    char buf[WBUF_SIZE];
+    cpu_set_t set;
+    int fd;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    memset(buf, ',', sizeof(buf));
+    fd = open(dev_path, O_WRONLY);
+    if (fd < 0) {
+        perror(dev_path);
+        return NULL;
+    }
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (write(fd, buf, sizeof(buf)) == sizeof(buf))
+            w->commas += sizeof(buf);
+    }
+    close(fd);
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+    struct writer *w;
+    int n, i;
+
+    if (argc > 3)
+        dev_path = argv[3];
+    w = calloc(max_threads, sizeof(*w));
+
+    printf("%8s %16s %16s %10s\n", "threads", "commas/s", "per thread", "lost");
+    for (n = 1; n <= max_threads; n++) {
+        unsigned long long before, after, written = 0;
+        double t0, t1;
+
+        atomic_store(&stop, 0);
+        before = read_counter();
+        t0 = now();
+        for (i = 0; i < n; i++) {
+            w[i].cpu = i;
+            w[i].commas = 0;
+            pthread_create(&w[i].tid, NULL, writer_fn, &w[i]);
+        }
+        usleep(seconds * 1e6);
+        atomic_store(&stop, 1);
+        for (i = 0; i < n; i++) {
+            pthread_join(w[i].tid, NULL);
+            written += w[i].commas;
+        }
+        t1 = now();
+        after = read_counter();
+
+        printf("%8d %16.0f %16.0f %10lld\n", n, (after - before) / (t1 - t0),
+               (after - before) / (t1 - t0) / n,
+               (long long)(written - (after - before)));
+    }
+    free(w);
+    return 0;
+}
@@ -17,6 +17,29 @@
 #include <linux/time64.h>
 #include <linux/math64.h>
 #include <linux/utsname.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/sched/signal.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/highmem.h>
+#include <linux/rcupdate.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/percpu_counter.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+
+#include "coma_scan.h"
+#include "io_lab.h"
+
+#define CREATE_TRACE_POINTS
+#include "io_lab_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Aleksei Lapin");
@@ -24,137 +47,1184 @@ MODULE_DESCRIPTION("Simple module to start");
 
 #define DEVICE_NAME "io_lab"
 
+/* Writes up to BUF_SIZE are copied on stack, longer ones stream through a page */
 #define BUF_SIZE 256
 
-char ibuf[BUF_SIZE];
-static u64 coma_count = 0; 
+/*
+ * Byte histogram is sharded per CPU: writers only touch the shard of the CPU
+ * they run on, readers sum all shards. Each shard is guarded by
+ * u64_stats_sync so the 64-bit values are never torn on 32-bit hosts.
+ * The sum is not an atomic snapshot of all shards, but it includes every
+ * write that completed before the read started and never goes backwards.
+ */
+struct hist_pcpu {
+    u64 bins[256];
+    struct u64_stats_sync syncp;
+};
+
+/*
+ * Set of tracked bytes. All 256 bins are always counted, read() and poll()
+ * report the sum of the tracked ones. Replaced under hist_lock, writers use
+ * it under RCU.
+ */
+struct hist_cfg {
+    u8 weight[256];     /* 1 for tracked bytes, 0 for the rest */
+    u8 bytes[256];      /* tracked bytes in ascending order */
+    int nr;
+};
+
+/*
+ * Reset leaves the shards alone, zeroing them under concurrent writers would
+ * lose updates. It snapshots the sums into hist_base instead and readers
+ * subtract it. Every increment lands either before or after the snapshot of
+ * its shard, so it is never lost and never counted twice.
+ */
+
+/*
+ * Aho-Corasick automaton over the registered patterns, compiled to a full
+ * transition table so matching costs one lookup per byte. Replaced under
+ * ac_lock, writers use it under RCU. gen tells open files whose saved state
+ * belongs to an older automaton.
+ */
+struct ac_automaton {
+    u64 gen;
+    int nr_patterns;
+    u32 nr_states;
+    u16 *out;       /* patterns ending in a state, suffixes included */
+    u16 *delta;     /* nr_states x 256 next states */
+};
+
+/* Match counts, sharded and reset the same way as the histogram */
+struct ac_pcpu {
+    u64 counts[IO_LAB_PATTERNS_MAX];
+    struct u64_stats_sync syncp;
+};
+
+/*
+ * Value shown by read() for poll() thresholds. Summing the histogram shards
+ * on every write would be too slow, so writers also feed a percpu_counter
+ * whose approximate value is enough to tell when a threshold is still far
+ * away. Near the threshold __percpu_counter_compare() sums it exactly.
+ * With no threshold armed nobody feeds it, large writes would otherwise
+ * take its lock every time; arming rebuilds it from the shards.
+ */
+#define WATCH_BATCH 64
+
+/*
+ * Per operation statistics for debugfs. Latency bin N counts calls that took
+ * [2^(N-1), 2^N) ns, bin 0 the ones under a nanosecond.
+ */
+enum io_lab_op {
+    IO_LAB_OP_OPEN,
+    IO_LAB_OP_RELEASE,
+    IO_LAB_OP_READ,
+    IO_LAB_OP_WRITE,
+    IO_LAB_OP_IOCTL,
+    IO_LAB_OP_NR,
+};
+
+static const char * const io_lab_op_names[IO_LAB_OP_NR] = {
+    [IO_LAB_OP_OPEN]    = "open",
+    [IO_LAB_OP_RELEASE] = "release",
+    [IO_LAB_OP_READ]    = "read",
+    [IO_LAB_OP_WRITE]   = "write",
+    [IO_LAB_OP_IOCTL]   = "ioctl",
+};
+
+#define LAT_BINS 65
+
+struct op_stat {
+    u64 calls;
+    u64 bytes;
+    u64 lat[LAT_BINS];
+};
+
+struct stats_pcpu {
+    struct op_stat op[IO_LAB_OP_NR];
+    struct u64_stats_sync syncp;
+};
+
+/* One /dev/io_lab minor, each has its own counters and patterns */
+struct io_lab_dev {
+    struct cdev cdev;
+
+    struct hist_pcpu __percpu *hist;
+    struct hist_cfg __rcu *hist_cfg;
+    struct mutex hist_lock;
+    u64 hist_base[256];
+    u64 hist_scratch[256];      /* under hist_lock */
+
+    struct ac_automaton __rcu *ac;
+    u64 ac_gen;                 /* under ac_lock */
+    struct ac_pcpu __percpu *ac_counts;
+    struct mutex ac_lock;
+    u64 ac_base[IO_LAB_PATTERNS_MAX];
+
+    struct percpu_counter tracked_total;
+    wait_queue_head_t watch_wq;
+    spinlock_t watch_lock;
+    struct list_head watch_list;    /* armed files, under watch_lock */
+    u64 watch_next;                 /* lowest armed threshold not reached yet */
+
+    struct stats_pcpu __percpu *stats;
+};
+
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of /dev/io_labN devices, a single one is called /dev/io_lab");
+
+static bool file_counters;
+module_param(file_counters, bool, 0444);
+MODULE_PARM_DESC(file_counters, "Also count tracked bytes per open file");
+
+static bool stats_enabled = true;
+module_param(stats_enabled, bool, 0644);
+MODULE_PARM_DESC(stats_enabled, "Collect call counts and latencies for debugfs");
+
+#define IO_LAB_DEVICES_MAX 64
+
+static struct io_lab_dev *devs;
+static struct dentry *debugfs_root;
+
+/* Long in-place scans are split so the CPU is given up between pieces */
+#define RING_SCAN_STEP (64 * 1024)
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+#define iov_iter_is_bvec(i) (!!((i)->type & ITER_BVEC))
+#endif
+
+/* Per open file state, kept in file->private_data */
+struct io_lab_file {
+    struct io_lab_dev *dev;
+    atomic64_t count;           /* tracked bytes written through this file */
+    struct mutex lock;          /* serialises ring setup and consumption */
+    struct io_lab_ring *ring;   /* header page, the data follows it */
+    char *ring_data;
+    u32 ring_size;
+    u32 ring_tail;              /* authoritative copy, userspace may scribble ring->tail */
+    u64 ac_gen;                 /* automaton the saved state belongs to */
+    u32 ac_state;               /* carried over from the previous write */
+    struct list_head watch_node;    /* on watch_list while armed */
+    u64 watch_target;
+    u64 watch_delta;
+    bool watch_fired;
+};
 
 static dev_t major = 0; /* The major number assigned to the device driver */
 static struct class *dev_class;
-static struct cdev io_dev;
 
 static int __init chdrv_init(void);
 static void __exit chdrv_exit(void);
 
-static ssize_t my_read(struct file *filp, char __user *buf, size_t len, loff_t *off);
-static ssize_t my_write(struct file *filp, const char __user *buf, size_t len, loff_t *off);
+static ssize_t my_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t my_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static int my_open(struct inode *inode, struct file *file);
 static int my_release(struct inode *inode, struct file *file);
 static long my_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int my_mmap(struct file *file, struct vm_area_struct *vma);
+static __poll_t my_poll(struct file *file, poll_table *wait);
 
 static struct file_operations fops = {
     .owner          = THIS_MODULE,
-    .read           = my_read,
-    .write          = my_write,
+    .read_iter      = my_read_iter,
+    .write_iter     = my_write_iter,
+    .splice_write   = iter_file_splice_write,
     .open           = my_open,
     .release        = my_release,
     .unlocked_ioctl = my_ioctl,
+    .mmap           = my_mmap,
+    .poll           = my_poll,
 };
 
-static ssize_t my_read(struct file *filp, char __user *buf, size_t len, loff_t *off){
-    pr_info("Driver: read()\n");
-    u64 i = 0;
-    for(i = 0; i < BUF_SIZE;i++)
-        ibuf[i] = 0;
-    sprintf(ibuf, "%lld", coma_count);
-    int count = strlen(ibuf);
-    ibuf[count] = '\n';
-    count++;
-    if (*off > 0 || len < count) {
+static void watch_feed(struct io_lab_dev *d, size_t n){
+    if (READ_ONCE(d->watch_next) != U64_MAX)
+        percpu_counter_add_batch(&d->tracked_total, n, WATCH_BATCH);
+}
+
+/*
+ * Count every byte of buf into this CPU's shard, returns how many of them are
+ * tracked. IO_LAB_HIST_GET needs all 256 bins, so there is no shortcut for a
+ * single tracked byte.
+ */
+static size_t hist_account(struct io_lab_dev *d, const char *buf, size_t len){
+    const struct hist_cfg *cfg;
+    struct hist_pcpu *pc;
+    size_t n;
+
+    rcu_read_lock();
+    cfg = rcu_dereference(d->hist_cfg);
+    pc = get_cpu_ptr(d->hist);
+    u64_stats_update_begin(&pc->syncp);
+    n = coma_hist((const unsigned char *)buf, len, pc->bins, cfg->weight);
+    u64_stats_update_end(&pc->syncp);
+    put_cpu_ptr(d->hist);
+    if (n)
+        watch_feed(d, n);
+    rcu_read_unlock();
+    return n;
+}
+
+static u64 hist_bin_sum(struct io_lab_dev *d, u8 byte){
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct hist_pcpu *pc = per_cpu_ptr(d->hist, cpu);
+        unsigned int start;
+        u64 val;
+
+        do {
+            start = u64_stats_fetch_begin(&pc->syncp);
+            val = pc->bins[byte];
+        } while (u64_stats_fetch_retry(&pc->syncp, start));
+        sum += val;
+    }
+    return sum;
+}
+
+static void hist_sum(struct io_lab_dev *d, u64 *bins){
+    int i;
+
+    for (i = 0; i < 256; i++)
+        bins[i] = hist_bin_sum(d, i);
+}
+
+/* Sum of tracked bins since the last reset, this is what read() shows */
+static u64 hist_tracked_sum(struct io_lab_dev *d){
+    const struct hist_cfg *cfg;
+    u64 sum = 0;
+    int i;
+
+    mutex_lock(&d->hist_lock);
+    cfg = rcu_dereference_protected(d->hist_cfg, lockdep_is_held(&d->hist_lock));
+    for (i = 0; i < cfg->nr; i++)
+        sum += hist_bin_sum(d, cfg->bytes[i]) - d->hist_base[cfg->bytes[i]];
+    mutex_unlock(&d->hist_lock);
+    return sum;
+}
+
+/* Mark files whose threshold is reached and find the next one, under watch_lock */
+static void watch_update_locked(struct io_lab_dev *d){
+    s64 now = percpu_counter_sum(&d->tracked_total);
+    u64 next = U64_MAX;
+    struct io_lab_file *f;
+
+    list_for_each_entry(f, &d->watch_list, watch_node) {
+        if (f->watch_fired)
+            continue;
+        if (now >= 0 && f->watch_target <= (u64)now)
+            f->watch_fired = true;
+        else
+            next = min(next, f->watch_target);
+    }
+    WRITE_ONCE(d->watch_next, next);
+}
+
+static void watch_fire(struct io_lab_dev *d){
+    spin_lock(&d->watch_lock);
+    watch_update_locked(d);
+    spin_unlock(&d->watch_lock);
+    wake_up_interruptible_poll(&d->watch_wq, POLLIN | POLLRDNORM);
+}
+
+/* Called by writers after each piece, cheap unless a threshold is close */
+static void watch_check(struct io_lab_dev *d){
+    u64 next = READ_ONCE(d->watch_next);
+
+    if (likely(next == U64_MAX))
+        return;
+    if (__percpu_counter_compare(&d->tracked_total, next, WATCH_BATCH) >= 0)
+        watch_fire(d);
+}
+
+/* read() restarts from zero, bring tracked_total along, under hist_lock */
+static void watch_rebase(struct io_lab_dev *d){
+    percpu_counter_add(&d->tracked_total, -percpu_counter_sum(&d->tracked_total));
+    watch_fire(d);
+}
+
+static void watch_arm(struct io_lab_file *f, u64 target, u64 delta){
+    struct io_lab_dev *d = f->dev;
+    u64 now = hist_tracked_sum(d);
+
+    spin_lock(&d->watch_lock);
+    /* writers stopped feeding it when nothing was armed */
+    if (READ_ONCE(d->watch_next) == U64_MAX)
+        percpu_counter_set(&d->tracked_total, now);
+    if (list_empty(&f->watch_node))
+        list_add(&f->watch_node, &d->watch_list);
+    f->watch_target = target;
+    f->watch_delta = delta;
+    f->watch_fired = false;
+    watch_update_locked(d);
+    spin_unlock(&d->watch_lock);
+}
+
+static void watch_disarm(struct io_lab_file *f){
+    struct io_lab_dev *d = f->dev;
+
+    spin_lock(&d->watch_lock);
+    f->watch_delta = 0;
+    if (!list_empty(&f->watch_node)) {
+        list_del_init(&f->watch_node);
+        watch_update_locked(d);
+    }
+    spin_unlock(&d->watch_lock);
+}
+
+static long watch_set(struct io_lab_file *f, const struct io_lab_watch *w){
+    if (w->delta)
+        watch_arm(f, hist_tracked_sum(f->dev) + w->delta, w->delta);
+    else if (w->threshold)
+        watch_arm(f, w->threshold, 0);
+    else
+        watch_disarm(f);
+    return 0;
+}
+
+/* Copy out the histogram (if bins is set) and optionally reset it */
+static void hist_get(struct io_lab_dev *d, u64 *bins, bool reset){
+    int i;
+
+    mutex_lock(&d->hist_lock);
+    hist_sum(d, d->hist_scratch);
+    if (bins) {
+        for (i = 0; i < 256; i++)
+            bins[i] = d->hist_scratch[i] - d->hist_base[i];
+    }
+    if (reset) {
+        memcpy(d->hist_base, d->hist_scratch, sizeof(d->hist_base));
+        watch_rebase(d);
+    }
+    mutex_unlock(&d->hist_lock);
+}
+
+static struct hist_cfg *hist_cfg_alloc(const struct io_lab_mask *mask){
+    struct hist_cfg *cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+    int i;
+
+    if (!cfg)
+        return NULL;
+    for (i = 0; i < 256; i++) {
+        if (mask->bits[i / 64] & (1ULL << (i % 64))) {
+            cfg->weight[i] = 1;
+            cfg->bytes[cfg->nr++] = i;
+        }
+    }
+    return cfg;
+}
+
+static int hist_set_tracked(struct io_lab_dev *d, const struct io_lab_mask *mask){
+    struct hist_cfg *cfg = hist_cfg_alloc(mask);
+    struct hist_cfg *old;
+
+    if (!cfg)
+        return -ENOMEM;
+
+    mutex_lock(&d->hist_lock);
+    old = rcu_dereference_protected(d->hist_cfg, lockdep_is_held(&d->hist_lock));
+    rcu_assign_pointer(d->hist_cfg, cfg);
+    /* once no writer counts with the old set, start from zero */
+    synchronize_rcu();
+    hist_sum(d, d->hist_base);
+    watch_rebase(d);
+    mutex_unlock(&d->hist_lock);
+
+    kfree(old);
+    return 0;
+}
+
+static void hist_get_tracked(struct io_lab_dev *d, struct io_lab_mask *mask){
+    const struct hist_cfg *cfg;
+    int i;
+
+    memset(mask, 0, sizeof(*mask));
+    mutex_lock(&d->hist_lock);
+    cfg = rcu_dereference_protected(d->hist_cfg, lockdep_is_held(&d->hist_lock));
+    for (i = 0; i < cfg->nr; i++)
+        mask->bits[cfg->bytes[i] / 64] |= 1ULL << (cfg->bytes[i] % 64);
+    mutex_unlock(&d->hist_lock);
+}
+
+static void ac_free(struct ac_automaton *a){
+    if (!a)
+        return;
+    kvfree(a->delta);
+    kfree(a->out);
+    kfree(a);
+}
+
+/* Trie of all patterns, then BFS fills failure transitions into the table */
+static struct ac_automaton *ac_build(const struct io_lab_patterns *p){
+    struct ac_automaton *a;
+    u32 nr_states = 1;
+    u32 head = 0, tail = 0;
+    u16 *queue, *fail;
+    int i, j;
+
+    for (i = 0; i < p->nr; i++)
+        nr_states += p->pat[i].len;
+
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    queue = kcalloc(nr_states, sizeof(*queue), GFP_KERNEL);
+    fail = kcalloc(nr_states, sizeof(*fail), GFP_KERNEL);
+    if (!a || !queue || !fail)
+        goto nomem;
+    a->out = kcalloc(nr_states, sizeof(*a->out), GFP_KERNEL);
+    a->delta = kvzalloc(nr_states * 256 * sizeof(*a->delta), GFP_KERNEL);
+    if (!a->out || !a->delta)
+        goto nomem;
+
+    /* state 0 is the root, a zero transition means "no trie edge" for now */
+    a->nr_states = 1;
+    for (i = 0; i < p->nr; i++) {
+        u32 st = 0;
+
+        for (j = 0; j < p->pat[i].len; j++) {
+            u16 *next = &a->delta[st * 256 + p->pat[i].data[j]];
+
+            if (!*next)
+                *next = a->nr_states++;
+            st = *next;
+        }
+        a->out[st] |= 1 << i;
+    }
+    a->nr_patterns = p->nr;
+
+    for (i = 0; i < 256; i++) {
+        u16 child = a->delta[i];
+
+        if (child)
+            queue[tail++] = child;
+    }
+    while (head < tail) {
+        u16 st = queue[head++];
+
+        for (i = 0; i < 256; i++) {
+            u16 *next = &a->delta[st * 256 + i];
+
+            if (*next) {
+                fail[*next] = a->delta[fail[st] * 256 + i];
+                a->out[*next] |= a->out[fail[*next]];
+                queue[tail++] = *next;
+            } else {
+                *next = a->delta[fail[st] * 256 + i];
+            }
+        }
+    }
+
+    kfree(queue);
+    kfree(fail);
+    return a;
+
+nomem:
+    kfree(queue);
+    kfree(fail);
+    ac_free(a);
+    return NULL;
+}
+
+/* Match buf continuing from the state this file stopped in */
+static void ac_account(struct io_lab_file *f, const char *buf, size_t len){
+    struct io_lab_dev *d = f->dev;
+    const struct ac_automaton *a;
+    struct ac_pcpu *pc;
+    size_t i;
+    u32 st;
+
+    rcu_read_lock();
+    a = rcu_dereference(d->ac);
+    if (!a)
+        goto out;
+
+    /* racing writers on one file may leave a stale pair, hence the bound check */
+    st = READ_ONCE(f->ac_state);
+    if (READ_ONCE(f->ac_gen) != a->gen || st >= a->nr_states)
+        st = 0;
+
+    pc = get_cpu_ptr(d->ac_counts);
+    u64_stats_update_begin(&pc->syncp);
+    for (i = 0; i < len; i++) {
+        st = a->delta[st * 256 + (u8)buf[i]];
+        if (unlikely(a->out[st])) {
+            unsigned long mask = a->out[st];
+            int bit;
+
+            for_each_set_bit(bit, &mask, IO_LAB_PATTERNS_MAX)
+                pc->counts[bit]++;
+        }
+    }
+    u64_stats_update_end(&pc->syncp);
+    put_cpu_ptr(d->ac_counts);
+
+    WRITE_ONCE(f->ac_state, st);
+    WRITE_ONCE(f->ac_gen, a->gen);
+out:
+    rcu_read_unlock();
+}
+
+static u64 ac_count_sum(struct io_lab_dev *d, int pattern){
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct ac_pcpu *pc = per_cpu_ptr(d->ac_counts, cpu);
+        unsigned int start;
+        u64 val;
+
+        do {
+            start = u64_stats_fetch_begin(&pc->syncp);
+            val = pc->counts[pattern];
+        } while (u64_stats_fetch_retry(&pc->syncp, start));
+        sum += val;
+    }
+    return sum;
+}
+
+static void ac_reset_locked(struct io_lab_dev *d){
+    int i;
+
+    for (i = 0; i < IO_LAB_PATTERNS_MAX; i++)
+        d->ac_base[i] = ac_count_sum(d, i);
+}
+
+static int ac_set(struct io_lab_dev *d, const struct io_lab_patterns *p){
+    struct ac_automaton *a = NULL;
+    struct ac_automaton *old;
+    int i;
+
+    if (p->nr > IO_LAB_PATTERNS_MAX)
+        return -EINVAL;
+    for (i = 0; i < p->nr; i++) {
+        if (p->pat[i].len == 0 || p->pat[i].len > IO_LAB_PATTERN_LEN)
+            return -EINVAL;
+    }
+    if (p->nr) {
+        a = ac_build(p);
+        if (!a)
+            return -ENOMEM;
+    }
+
+    mutex_lock(&d->ac_lock);
+    if (a)
+        a->gen = ++d->ac_gen;
+    old = rcu_dereference_protected(d->ac, lockdep_is_held(&d->ac_lock));
+    rcu_assign_pointer(d->ac, a);
+    /* once no writer matches with the old automaton, start from zero */
+    synchronize_rcu();
+    ac_reset_locked(d);
+    mutex_unlock(&d->ac_lock);
+
+    ac_free(old);
+    return 0;
+}
+
+static void ac_get(struct io_lab_dev *d, struct io_lab_matches *m){
+    const struct ac_automaton *a;
+    int i;
+
+    memset(m, 0, sizeof(*m));
+    mutex_lock(&d->ac_lock);
+    a = rcu_dereference_protected(d->ac, lockdep_is_held(&d->ac_lock));
+    if (a) {
+        m->nr = a->nr_patterns;
+        for (i = 0; i < a->nr_patterns; i++)
+            m->counts[i] = ac_count_sum(d, i) - d->ac_base[i];
+    }
+    mutex_unlock(&d->ac_lock);
+}
+
+/* Every byte written to the device, whatever the path, ends up here */
+static void io_lab_account(struct io_lab_file *f, const char *buf, size_t len){
+    size_t n = hist_account(f->dev, buf, len);
+
+    if (file_counters && n)
+        atomic64_add(n, &f->count);
+    ac_account(f, buf, len);
+    watch_check(f->dev);
+}
+
+static void io_lab_account_long(struct io_lab_file *f, const char *buf, size_t len){
+    while (len > RING_SCAN_STEP) {
+        io_lab_account(f, buf, RING_SCAN_STEP);
+        buf += RING_SCAN_STEP;
+        len -= RING_SCAN_STEP;
+        cond_resched();
+    }
+    io_lab_account(f, buf, len);
+}
+
+/* Count everything the producer published since the last call */
+static long ring_consume(struct io_lab_file *f){
+    u32 head, tail;
+    long ret;
+
+    mutex_lock(&f->lock);
+    if (!f->ring) {
+        ret = 0;
+        goto out;
+    }
+
+    head = smp_load_acquire(&f->ring->head);
+    tail = f->ring_tail;
+    /* head is written by user space, a bad one is its error to see, not dmesg's */
+    if (head - tail > f->ring_size) {
+        ret = -EINVAL;
+        goto out;
+    }
+    ret = head - tail;
+
+    while (tail != head) {
+        u32 pos = tail & (f->ring_size - 1);
+        u32 n = min(head - tail, f->ring_size - pos);
+
+        io_lab_account_long(f, f->ring_data + pos, n);
+        tail += n;
+    }
+    f->ring_tail = tail;
+    smp_store_release(&f->ring->tail, tail);
+out:
+    mutex_unlock(&f->lock);
+    return ret;
+}
+
+/* Start of a timed operation, 0 when statistics are off */
+static u64 stat_start(void){
+    return READ_ONCE(stats_enabled) ? ktime_get_ns() : 0;
+}
+
+/* Account one call that started at start, returns its duration */
+static u64 stat_end(struct io_lab_dev *d, enum io_lab_op op, u64 start, size_t bytes){
+    struct stats_pcpu *pc;
+    struct op_stat *st;
+    u64 ns;
+
+    if (!start)
+        return 0;
+    ns = ktime_get_ns() - start;
+
+    pc = get_cpu_ptr(d->stats);
+    st = &pc->op[op];
+    u64_stats_update_begin(&pc->syncp);
+    st->calls++;
+    st->bytes += bytes;
+    st->lat[fls64(ns)]++;
+    u64_stats_update_end(&pc->syncp);
+    put_cpu_ptr(d->stats);
+    return ns;
+}
+
+static unsigned int io_lab_minor(const struct io_lab_dev *d){
+    return MINOR(d->cdev.dev);
+}
+
+static ssize_t io_lab_read(struct kiocb *iocb, struct iov_iter *to){
+    struct io_lab_file *f = iocb->ki_filp->private_data;
+    char obuf[24]; /* u64 in decimal + '\n' */
+    int count;
+    long ret;
+    u64 val;
+
+    ret = ring_consume(f);
+    if (ret < 0)
+        return ret;
+    val = hist_tracked_sum(f->dev);
+    count = snprintf(obuf, sizeof(obuf), "%llu\n", val);
+    if (iocb->ki_pos > 0 || iov_iter_count(to) < count) {
         return 0;
     }
 
-    if (copy_to_user(buf, ibuf, count) != 0) {
+    if (copy_to_iter(obuf, count, to) != count) {
         return -EFAULT;
     }
+
+    /* in delta mode every read moves the threshold */
+    if (READ_ONCE(f->watch_delta))
+        watch_arm(f, val + f->watch_delta, f->watch_delta);
     
-    *off = count;
+    iocb->ki_pos = count;
     
     return count;
 }
 
-static ssize_t my_write(struct file *filp, const char __user *buf, size_t len, loff_t *off){
-    printk(KERN_INFO "Driver: write()\n");
-  
-    if(len > BUF_SIZE)
-      return 0;
-  
-    if (copy_from_user(ibuf, buf, len) != 0) {
-      return -EFAULT;
-    }
-    u64 i = 0;
-    for(i = 0; i < len; i++){
-        if (ibuf[i] == ','){
-            coma_count++;
-            if(coma_count <= 0){
-                pr_err("Integer overflow");
-                return -EFAULT;
-            }
+static ssize_t my_read_iter(struct kiocb *iocb, struct iov_iter *to){
+    struct io_lab_dev *d = ((struct io_lab_file *)iocb->ki_filp->private_data)->dev;
+    size_t len = iov_iter_count(to);
+    u64 start = stat_start();
+    ssize_t ret = io_lab_read(iocb, to);
+    u64 ns = stat_end(d, IO_LAB_OP_READ, start, ret > 0 ? ret : 0);
+
+    trace_io_lab_read(io_lab_minor(d), len, ret, ns);
+    return ret;
+}
+
+/*
+ * Pages handed over by splice() are scanned where they are, without a
+ * bounce copy. A bvec may span several pages, so map them one by one.
+ */
+static void io_lab_account_bvec(struct io_lab_file *f, struct iov_iter *from){
+    const struct bio_vec *bv = from->bvec;
+    size_t skip = from->iov_offset;
+    size_t left = iov_iter_count(from);
+
+    while (left) {
+        size_t off = bv->bv_offset + skip;
+        size_t n = min3(left, (size_t)bv->bv_len - skip, PAGE_SIZE - offset_in_page(off));
+        struct page *page = bv->bv_page + (off >> PAGE_SHIFT);
+        char *p = kmap_atomic(page);
+
+        io_lab_account(f, p + offset_in_page(off), n);
+        kunmap_atomic(p);
+        left -= n;
+        skip += n;
+        if (skip == bv->bv_len) {
+            bv++;
+            skip = 0;
+        }
+    }
+    iov_iter_advance(from, iov_iter_count(from));
+}
+
+static ssize_t io_lab_write(struct kiocb *iocb, struct iov_iter *from){
+    /* on-stack copy: a shared buffer would let parallel writers clobber each other */
+    char sbuf[BUF_SIZE];
+    char *ibuf = sbuf;
+    size_t len = iov_iter_count(from);
+    size_t chunk = BUF_SIZE;
+    size_t done = 0;
+
+    if (len == 0)
+        return 0;
+
+    if (iov_iter_is_bvec(from)) {
+        io_lab_account_bvec(iocb->ki_filp->private_data, from);
+        return len;
+    }
+
+    /* Large writes are streamed through one page, however big they are */
+    if (len > BUF_SIZE) {
+        ibuf = (char *)__get_free_page(GFP_KERNEL);
+        if (!ibuf)
+            return -ENOMEM;
+        chunk = PAGE_SIZE;
+    }
+
+    while (done < len) {
+        size_t n = min(len - done, chunk);
+        size_t copied = copy_from_iter(ibuf, n, from);
+
+        io_lab_account(iocb->ki_filp->private_data, ibuf, copied);
+        done += copied;
+        if (copied < n)
+            break;
+        if (done < len) {
+            if (fatal_signal_pending(current))
+                break;
+            cond_resched();
         }
     }
-    return len;
+
+    if (ibuf != sbuf)
+        free_page((unsigned long)ibuf);
+    return done ? done : -EFAULT;
+}
+
+static ssize_t my_write_iter(struct kiocb *iocb, struct iov_iter *from){
+    struct io_lab_dev *d = ((struct io_lab_file *)iocb->ki_filp->private_data)->dev;
+    size_t len = iov_iter_count(from);
+    u64 start = stat_start();
+    ssize_t ret = io_lab_write(iocb, from);
+    u64 ns = stat_end(d, IO_LAB_OP_WRITE, start, ret > 0 ? ret : 0);
+
+    trace_io_lab_write(io_lab_minor(d), len, ret, ns);
+    return ret;
 }
 
 static int my_open(struct inode *inode, struct file *file){
-    pr_info("Device opened.\n");
+    struct io_lab_dev *d = container_of(inode->i_cdev, struct io_lab_dev, cdev);
+    u64 start = stat_start();
+    struct io_lab_file *f;
+
+    trace_io_lab_open(io_lab_minor(d));
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if (!f)
+        return -ENOMEM;
+    f->dev = d;
+    atomic64_set(&f->count, 0);
+    mutex_init(&f->lock);
+    INIT_LIST_HEAD(&f->watch_node);
+    file->private_data = f;
+    stat_end(d, IO_LAB_OP_OPEN, start, 0);
     return 0;
 }
 
 static int my_release(struct inode *inode, struct file *file){
-    pr_info("Device closed.\n");
+    struct io_lab_file *f = file->private_data;
+    struct io_lab_dev *d = f->dev;
+    u64 start = stat_start();
+
+    trace_io_lab_release(io_lab_minor(d));
+    watch_disarm(f);
+    vfree(f->ring);
+    kfree(f);
+    stat_end(d, IO_LAB_OP_RELEASE, start, 0);
     return 0;
 }
 
+static long hist_ioctl_get(struct io_lab_dev *d, unsigned long arg, bool reset){
+    struct io_lab_hist *h = kmalloc(sizeof(*h), GFP_KERNEL);
+    long ret = 0;
+
+    if (!h)
+        return -ENOMEM;
+    hist_get(d, h->bins, reset);
+    if (copy_to_user((void __user *)arg, h, sizeof(*h)))
+        ret = -EFAULT;
+    kfree(h);
+    return ret;
+}
+
+static long ac_ioctl_set(struct io_lab_dev *d, unsigned long arg){
+    struct io_lab_patterns *p = kmalloc(sizeof(*p), GFP_KERNEL);
+    long ret;
+
+    if (!p)
+        return -ENOMEM;
+    if (copy_from_user(p, (void __user *)arg, sizeof(*p)))
+        ret = -EFAULT;
+    else
+        ret = ac_set(d, p);
+    kfree(p);
+    return ret;
+}
+
+static long io_lab_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
+    struct io_lab_file *f = file->private_data;
+    struct io_lab_dev *d = f->dev;
+    void __user *uarg = (void __user *)arg;
+    struct io_lab_matches matches;
+    struct io_lab_watch watch;
+    struct io_lab_mask mask;
+    struct io_lab_bin bin;
+    __u64 count;
+
+    switch (cmd) {
+    case IO_LAB_RING_KICK:
+        return ring_consume(f);
+    case IO_LAB_SET_TRACKED:
+        if (copy_from_user(&mask, uarg, sizeof(mask)))
+            return -EFAULT;
+        return hist_set_tracked(d, &mask);
+    case IO_LAB_GET_TRACKED:
+        hist_get_tracked(d, &mask);
+        return copy_to_user(uarg, &mask, sizeof(mask)) ? -EFAULT : 0;
+    case IO_LAB_HIST_GET:
+        return hist_ioctl_get(d, arg, false);
+    case IO_LAB_HIST_GET_RESET:
+        return hist_ioctl_get(d, arg, true);
+    case IO_LAB_HIST_RESET:
+        hist_get(d, NULL, true);
+        return 0;
+    case IO_LAB_HIST_BIN:
+        if (copy_from_user(&bin, uarg, sizeof(bin)))
+            return -EFAULT;
+        if (bin.byte > 255)
+            return -EINVAL;
+        mutex_lock(&d->hist_lock);
+        bin.count = hist_bin_sum(d, bin.byte) - d->hist_base[bin.byte];
+        mutex_unlock(&d->hist_lock);
+        return copy_to_user(uarg, &bin, sizeof(bin)) ? -EFAULT : 0;
+    case IO_LAB_AC_SET:
+        return ac_ioctl_set(d, arg);
+    case IO_LAB_AC_GET:
+        ac_get(d, &matches);
+        return copy_to_user(uarg, &matches, sizeof(matches)) ? -EFAULT : 0;
+    case IO_LAB_AC_RESET:
+        mutex_lock(&d->ac_lock);
+        ac_reset_locked(d);
+        mutex_unlock(&d->ac_lock);
+        return 0;
+    case IO_LAB_WATCH:
+        if (copy_from_user(&watch, uarg, sizeof(watch)))
+            return -EFAULT;
+        return watch_set(f, &watch);
+    case IO_LAB_FILE_COUNT:
+        if (!file_counters)
+            return -EOPNOTSUPP;
+        count = atomic64_read(&f->count);
+        return copy_to_user(uarg, &count, sizeof(count)) ? -EFAULT : 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
 static long my_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
-    pr_info("Device ioctl.\n");
+    struct io_lab_dev *d = ((struct io_lab_file *)file->private_data)->dev;
+    u64 start = stat_start();
+    long ret = io_lab_ioctl(file, cmd, arg);
+
+    stat_end(d, IO_LAB_OP_IOCTL, start, 0);
+    trace_io_lab_ioctl(io_lab_minor(d), cmd, ret);
+    return ret;
+}
+
+static __poll_t my_poll(struct file *file, poll_table *wait){
+    struct io_lab_file *f = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &f->dev->watch_wq, wait);
+    spin_lock(&f->dev->watch_lock);
+    if (list_empty(&f->watch_node) || f->watch_fired)
+        mask = POLLIN | POLLRDNORM;
+    spin_unlock(&f->dev->watch_lock);
+    return mask;
+}
+
+/* One ring per open file: header page plus a power of two data area */
+static int my_mmap(struct file *file, struct vm_area_struct *vma){
+    struct io_lab_file *f = file->private_data;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long size = len - PAGE_SIZE;
+    void *mem;
+    int ret;
+
+    if (vma->vm_pgoff != 0 || len <= PAGE_SIZE || size > IO_LAB_RING_MAX || !is_power_of_2(size))
+        return -EINVAL;
+
+    mutex_lock(&f->lock);
+    if (f->ring) {
+        ret = -EBUSY;
+        goto out;
+    }
+    mem = vmalloc_user(len);
+    if (!mem) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    ret = remap_vmalloc_range(vma, mem, 0);
+    if (ret) {
+        vfree(mem);
+        goto out;
+    }
+    f->ring = mem;
+    f->ring_data = (char *)mem + PAGE_SIZE;
+    f->ring_size = size;
+    f->ring_tail = 0;
+    f->ring->size = size;
+out:
+    mutex_unlock(&f->lock);
+    return ret;
+}
+
+/* debugfs "stats": calls, bytes and non-empty latency bins of every operation */
+static int stats_show(struct seq_file *m, void *v){
+    struct io_lab_dev *d = m->private;
+    struct op_stat *sum;
+    int op, cpu, i;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+
+    for (op = 0; op < IO_LAB_OP_NR; op++) {
+        memset(sum, 0, sizeof(*sum));
+        for_each_possible_cpu(cpu) {
+            struct stats_pcpu *pc = per_cpu_ptr(d->stats, cpu);
+            const struct op_stat *st = &pc->op[op];
+            u64 calls, bytes, lat[LAT_BINS];
+            unsigned int start;
+
+            do {
+                start = u64_stats_fetch_begin(&pc->syncp);
+                calls = st->calls;
+                bytes = st->bytes;
+                memcpy(lat, st->lat, sizeof(lat));
+            } while (u64_stats_fetch_retry(&pc->syncp, start));
+            sum->calls += calls;
+            sum->bytes += bytes;
+            for (i = 0; i < LAT_BINS; i++)
+                sum->lat[i] += lat[i];
+        }
+
+        seq_printf(m, "%s: calls %llu bytes %llu\n", io_lab_op_names[op], sum->calls, sum->bytes);
+        for (i = 0; i < LAT_BINS; i++) {
+            if (!sum->lat[i])
+                continue;
+            seq_printf(m, "  [%llu, %llu) ns: %llu\n",
+                       i ? 1ULL << (i - 1) : 0ULL,
+                       i < 64 ? 1ULL << i : U64_MAX, sum->lat[i]);
+        }
+    }
+    kfree(sum);
+    return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file){
+    return single_open(file, stats_show, inode->i_private);
+}
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* Statistics are optional, a missing debugfs does not stop the driver */
+static void io_lab_dev_debugfs(struct io_lab_dev *d, const char *name){
+    struct dentry *dir;
+
+    if (IS_ERR_OR_NULL(debugfs_root))
+        return;
+    dir = debugfs_create_dir(name, debugfs_root);
+    if (!IS_ERR_OR_NULL(dir))
+        debugfs_create_file("stats", 0444, dir, d, &stats_fops);
+}
+
+static void io_lab_dev_free(struct io_lab_dev *d){
+    free_percpu(d->stats);
+    percpu_counter_destroy(&d->tracked_total);
+    kfree(rcu_dereference_protected(d->hist_cfg, 1));
+    ac_free(rcu_dereference_protected(d->ac, 1));
+    free_percpu(d->ac_counts);
+    free_percpu(d->hist);
+}
+
+/* Counters of a fresh device, tracking ',' only */
+static int io_lab_dev_alloc(struct io_lab_dev *d){
+    struct io_lab_mask comma = { .bits = { 1ULL << ',' } };
+    struct hist_cfg *cfg;
+    int cpu;
+
+    mutex_init(&d->hist_lock);
+    mutex_init(&d->ac_lock);
+    init_waitqueue_head(&d->watch_wq);
+    spin_lock_init(&d->watch_lock);
+    INIT_LIST_HEAD(&d->watch_list);
+    d->watch_next = U64_MAX;
+
+    d->hist = alloc_percpu(struct hist_pcpu);
+    d->ac_counts = alloc_percpu(struct ac_pcpu);
+    d->stats = alloc_percpu(struct stats_pcpu);
+    cfg = hist_cfg_alloc(&comma);
+    RCU_INIT_POINTER(d->hist_cfg, cfg);
+    if (!d->hist || !d->ac_counts || !d->stats || !cfg ||
+        percpu_counter_init(&d->tracked_total, 0, GFP_KERNEL)) {
+        kfree(cfg);
+        free_percpu(d->stats);
+        free_percpu(d->ac_counts);
+        free_percpu(d->hist);
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        u64_stats_init(&per_cpu_ptr(d->hist, cpu)->syncp);
+        u64_stats_init(&per_cpu_ptr(d->ac_counts, cpu)->syncp);
+        u64_stats_init(&per_cpu_ptr(d->stats, cpu)->syncp);
+    }
     return 0;
 }
 
 static int __init chdrv_init(void){
+    int ret = -1;
+    int i;
+
     pr_info("cpu_stat: Module loaded\n");
 
-    /* Allocating major numbers */
-    if(alloc_chrdev_region(&major, 0, 1, DEVICE_NAME) < 0){
-        pr_err("Cannot allocate major numbers.\n");
-        return -1;
+    if (nr_devices == 0 || nr_devices > IO_LAB_DEVICES_MAX) {
+        pr_err("nr_devices must be between 1 and %d.\n", IO_LAB_DEVICES_MAX);
+        return -EINVAL;
     }
 
-    /* cdev structure initialization */
-    cdev_init(&io_dev, &fops);
+    devs = kcalloc(nr_devices, sizeof(*devs), GFP_KERNEL);
+    if (!devs)
+        return -ENOMEM;
 
-    /* Adding device to the system */
-    if(cdev_add(&io_dev, major, 1) < 0){
-        pr_err("Cannot add the device to the system.\n");
-        goto rm_major;
+    /* Allocating major numbers */
+    if(alloc_chrdev_region(&major, 0, nr_devices, DEVICE_NAME) < 0){
+        pr_err("Cannot allocate major numbers.\n");
+        goto rm_devs;
     }
 
+    debugfs_root = debugfs_create_dir(DEVICE_NAME, NULL);
+
     /* Creating structure class */
-    if((dev_class = class_create(THIS_MODULE, DEVICE_NAME)) == NULL) {
+    dev_class = class_create(THIS_MODULE, DEVICE_NAME);
+    if (IS_ERR(dev_class)) {
         pr_err("Cannot create the structure class.\n");
+        ret = PTR_ERR(dev_class);
+        debugfs_remove_recursive(debugfs_root);
         goto rm_major;
     }
 
-    if(device_create(dev_class, NULL, major, NULL, DEVICE_NAME) < 0){
-        pr_err("Cannot create the device");
-        goto rm_class;
+    for (i = 0; i < nr_devices; i++) {
+        struct io_lab_dev *d = &devs[i];
+        dev_t devt = MKDEV(MAJOR(major), MINOR(major) + i);
+        char name[16];
+
+        if (nr_devices == 1)
+            snprintf(name, sizeof(name), DEVICE_NAME);
+        else
+            snprintf(name, sizeof(name), DEVICE_NAME "%d", i);
+
+        if (io_lab_dev_alloc(d) < 0) {
+            pr_err("Cannot allocate counters.\n");
+            goto rm_minors;
+        }
+
+        /* cdev structure initialization */
+        cdev_init(&d->cdev, &fops);
+
+        /* Adding device to the system */
+        if(cdev_add(&d->cdev, devt, 1) < 0){
+            pr_err("Cannot add the device to the system.\n");
+            io_lab_dev_free(d);
+            goto rm_minors;
+        }
+
+        if (IS_ERR(device_create(dev_class, NULL, devt, NULL, "%s", name))) {
+            pr_err("Cannot create the device");
+            cdev_del(&d->cdev);
+            io_lab_dev_free(d);
+            goto rm_minors;
+        }
+        io_lab_dev_debugfs(d, name);
     }
 
-    pr_info("Device created on /dev/%s\n", DEVICE_NAME);
+    if (nr_devices == 1)
+        pr_info("Device created on /dev/%s\n", DEVICE_NAME);
+    else
+        pr_info("Devices created on /dev/%s0..%u\n", DEVICE_NAME, nr_devices - 1);
 
     return 0;
 
-rm_class:
+rm_minors:
+    debugfs_remove_recursive(debugfs_root);
+    while (i--) {
+        device_destroy(dev_class, MKDEV(MAJOR(major), MINOR(major) + i));
+        cdev_del(&devs[i].cdev);
+        io_lab_dev_free(&devs[i]);
+    }
     class_destroy(dev_class);
 rm_major:
-    unregister_chrdev_region(major, 1);
-    return -1;
+    unregister_chrdev_region(major, nr_devices);
+rm_devs:
+    kfree(devs);
+    return ret;
 }
 
 static void __exit chdrv_exit(void){
-    device_destroy(dev_class, major);
+    int i;
+
+    debugfs_remove_recursive(debugfs_root);
+    for (i = 0; i < nr_devices; i++) {
+        device_destroy(dev_class, MKDEV(MAJOR(major), MINOR(major) + i));
+        cdev_del(&devs[i].cdev);
+        io_lab_dev_free(&devs[i]);
+    }
     class_destroy(dev_class);
-    cdev_del(&io_dev);
-    unregister_chrdev_region(major, 1);
+    unregister_chrdev_region(major, nr_devices);
+    kfree(devs);
     pr_info("cpu_stat: Module unloaded.\n");
 }
 
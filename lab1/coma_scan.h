@@ -0,0 +1,125 @@
+/*
+ * Delimiter counting kernels shared by the driver and bench/scan.c.
+ *
+ * coma_scan_bytes() is the reference byte loop, coma_scan_swar() handles
+ * eight bytes per step in general purpose registers and works everywhere.
+ * coma_hist() builds the full 256 bin histogram in one pass.
+ * On x86 there are also SSE2 and AVX2 variants built with GCC vector
+ * extensions; in the kernel they must run between kernel_fpu_begin() and
+ * kernel_fpu_end(), the caller decides when that is worth it.
+ */
+#ifndef COMA_SCAN_H
+#define COMA_SCAN_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#define COMA_ONES  0x0101010101010101ULL
+#define COMA_HIGHS 0x8080808080808080ULL
+#define COMA_LOWS  0x7f7f7f7f7f7f7f7fULL
+
+static inline size_t coma_scan_bytes(const unsigned char *buf, size_t len, unsigned char c)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; i++)
+        n += buf[i] == c;
+    return n;
+}
+
+/* sum of eight byte lanes, each lane <= 255 */
+static inline size_t coma_fold_lanes(uint64_t acc)
+{
+    acc = (acc & 0x00ff00ff00ff00ffULL) + ((acc >> 8) & 0x00ff00ff00ff00ffULL);
+    return (acc * 0x0001000100010001ULL) >> 48;
+}
+
+static inline size_t coma_scan_swar(const unsigned char *buf, size_t len, unsigned char c)
+{
+    const uint64_t pattern = COMA_ONES * c;
+    size_t n = 0;
+
+    while (len >= 8) {
+        /* lanes are bumped at most 255 times before folding */
+        size_t words = len / 8 > 255 ? 255 : len / 8;
+        uint64_t acc = 0;
+
+        len -= words * 8;
+        while (words--) {
+            uint64_t w, x;
+
+            __builtin_memcpy(&w, buf, 8);
+            x = w ^ pattern;
+            /* high bit of a lane is set iff that byte of x is zero */
+            acc += (~(((x & COMA_LOWS) + COMA_LOWS) | x) & COMA_HIGHS) >> 7;
+            buf += 8;
+        }
+        n += coma_fold_lanes(acc);
+    }
+    return n + coma_scan_bytes(buf, len, c);
+}
+
+/*
+ * One pass histogram: every byte bumps its own bin. weight[] only selects
+ * what is returned, the sum of the weights of all bytes seen.
+ */
+static inline size_t coma_hist(const unsigned char *buf, size_t len,
+                               uint64_t *bins, const unsigned char *weight)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        bins[buf[i]]++;
+        n += weight[buf[i]];
+    }
+    return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define COMA_SCAN_HAVE_SIMD 1
+
+typedef unsigned char coma_v16 __attribute__((vector_size(16)));
+typedef unsigned char coma_v32 __attribute__((vector_size(32)));
+
+#define COMA_SCAN_VEC(name, vtype, isa)                                        \
+static __attribute__((target(isa), noinline))                                  \
+size_t name(const unsigned char *buf, size_t len, unsigned char c)             \
+{                                                                              \
+    const size_t vlen = sizeof(vtype);                                         \
+    vtype pattern;                                                             \
+    size_t i, n = 0;                                                           \
+                                                                               \
+    for (i = 0; i < vlen; i++)                                                 \
+        pattern[i] = c;                                                        \
+    while (len >= vlen) {                                                      \
+        size_t vecs = len / vlen > 255 ? 255 : len / vlen;                     \
+        vtype acc = {0};                                                       \
+                                                                               \
+        len -= vecs * vlen;                                                    \
+        while (vecs--) {                                                       \
+            vtype v;                                                           \
+                                                                               \
+            __builtin_memcpy(&v, buf, vlen);                                   \
+            /* matching lanes compare to -1, subtracting adds one */           \
+            acc -= (vtype)(v == pattern);                                      \
+            buf += vlen;                                                       \
+        }                                                                      \
+        for (i = 0; i < vlen; i++)                                             \
+            n += acc[i];                                                       \
+    }                                                                          \
+    return n + coma_scan_swar(buf, len, c);                                    \
+}
+
+COMA_SCAN_VEC(coma_scan_sse2, coma_v16, "sse2")
+COMA_SCAN_VEC(coma_scan_avx2, coma_v32, "avx2")
+
+#undef COMA_SCAN_VEC
+
+#endif /* x86 */
+
+#endif /* COMA_SCAN_H */
@@ -0,0 +1,132 @@
+/*
+ * Userspace interface of /dev/io_lab: ioctl numbers and shared structures.
+ * With nr_devices > 1 the minors are /dev/io_lab0, /dev/io_lab1 and so on,
+ * each one keeps its own counters, patterns and watchers.
+ */
+#ifndef IO_LAB_H
+#define IO_LAB_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <linux/types.h>
+#include <sys/ioctl.h>
+#endif
+
+#define IO_LAB_MAGIC 'c'
+
+/*
+ * Submission ring.
+ *
+ * mmap() of an open /dev/io_lab maps one header page followed by the ring
+ * data, so the mapping length is page size + ring size, where the ring size
+ * is a power of two multiple of the page size up to IO_LAB_RING_MAX.
+ * Producer copies bytes to data[head % size] and then publishes head with a
+ * release store. The driver counts everything between tail and head in place
+ * and moves tail on IO_LAB_RING_KICK or on read(). Both indices are free
+ * running byte counters.
+ */
+#define IO_LAB_RING_MAX (16 << 20)
+
+struct io_lab_ring {
+    __u32 head;     /* written by the producer */
+    __u32 pad1[15];
+    __u32 tail;     /* written by the driver */
+    __u32 pad2[15];
+    __u32 size;     /* data bytes, set by the driver */
+};
+
+/* Count pending ring data, returns the number of bytes consumed */
+#define IO_LAB_RING_KICK _IO(IO_LAB_MAGIC, 1)
+
+/*
+ * Byte histogram.
+ *
+ * Every byte value has its own bin, read() and poll() only look at the sum
+ * of the bins in the tracked set. The default set is a single ','. Changing the set resets the
+ * histogram. Reset never loses a concurrent write: it is counted either
+ * before or after the reset.
+ */
+
+/* Bit N of the mask stands for byte value N */
+struct io_lab_mask {
+    __u64 bits[4];
+};
+
+struct io_lab_hist {
+    __u64 bins[256];
+};
+
+struct io_lab_bin {
+    __u32 byte;     /* in: byte value */
+    __u32 pad;
+    __u64 count;    /* out */
+};
+
+#define IO_LAB_SET_TRACKED    _IOW(IO_LAB_MAGIC, 2, struct io_lab_mask)
+#define IO_LAB_GET_TRACKED    _IOR(IO_LAB_MAGIC, 3, struct io_lab_mask)
+#define IO_LAB_HIST_GET       _IOR(IO_LAB_MAGIC, 4, struct io_lab_hist)
+/* Same as IO_LAB_HIST_GET, then reset in one step */
+#define IO_LAB_HIST_GET_RESET _IOR(IO_LAB_MAGIC, 5, struct io_lab_hist)
+#define IO_LAB_HIST_RESET     _IO(IO_LAB_MAGIC, 6)
+#define IO_LAB_HIST_BIN       _IOWR(IO_LAB_MAGIC, 7, struct io_lab_bin)
+
+/*
+ * Multi-pattern matching.
+ *
+ * IO_LAB_AC_SET replaces the whole pattern set, the patterns are compiled
+ * into one Aho-Corasick automaton and every write is matched in a single
+ * pass. Matching state is kept per open file, so a match split between two
+ * writes to the same descriptor is still counted. Overlapping matches are
+ * all counted. Setting the patterns resets the counts, nr == 0 disables
+ * matching.
+ */
+#define IO_LAB_PATTERNS_MAX 16
+#define IO_LAB_PATTERN_LEN  32
+
+struct io_lab_pattern {
+    __u32 len;
+    __u8 data[IO_LAB_PATTERN_LEN];
+};
+
+struct io_lab_patterns {
+    __u32 nr;
+    __u32 pad;
+    struct io_lab_pattern pat[IO_LAB_PATTERNS_MAX];
+};
+
+struct io_lab_matches {
+    __u32 nr;       /* number of patterns */
+    __u32 pad;
+    __u64 counts[IO_LAB_PATTERNS_MAX];
+};
+
+#define IO_LAB_AC_SET   _IOW(IO_LAB_MAGIC, 8, struct io_lab_patterns)
+#define IO_LAB_AC_GET   _IOR(IO_LAB_MAGIC, 9, struct io_lab_matches)
+#define IO_LAB_AC_RESET _IO(IO_LAB_MAGIC, 10)
+
+/*
+ * Threshold notifications.
+ *
+ * By default the device is always readable for poll(). IO_LAB_WATCH arms
+ * the file instead: poll() reports POLLIN only once the value read() shows
+ * reaches the threshold. With a non-zero delta the threshold is the current
+ * value plus delta, and it moves to "value returned by read() + delta" after
+ * every read() on this file. Zero threshold and delta disarm the file.
+ */
+struct io_lab_watch {
+    __u64 threshold;
+    __u64 delta;
+};
+
+#define IO_LAB_WATCH _IOW(IO_LAB_MAGIC, 11, struct io_lab_watch)
+
+/*
+ * Tracked bytes written through this open file. The device total read()
+ * returns is shared by all files of one minor. Needs the module loaded with
+ * file_counters=1, fails with EOPNOTSUPP otherwise.
+ */
+#define IO_LAB_FILE_COUNT _IOR(IO_LAB_MAGIC, 12, __u64)
+
+#endif /* IO_LAB_H */
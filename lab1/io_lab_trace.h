@@ -0,0 +1,96 @@
+/*
+ * Tracepoints of /dev/io_lab, under events/io_lab/ in tracefs.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM io_lab
+
+#if !defined(_IO_LAB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IO_LAB_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(io_lab_file,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+
+    TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(io_lab_file, io_lab_open,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+DEFINE_EVENT(io_lab_file, io_lab_release,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+DECLARE_EVENT_CLASS(io_lab_rw,
+    TP_PROTO(unsigned int minor, size_t len, ssize_t ret, u64 ns),
+    TP_ARGS(minor, len, ret, ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, len)
+        __field(ssize_t, ret)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->len = len;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("minor=%u len=%zu ret=%zd ns=%llu",
+              __entry->minor, __entry->len, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(io_lab_rw, io_lab_read,
+    TP_PROTO(unsigned int minor, size_t len, ssize_t ret, u64 ns),
+    TP_ARGS(minor, len, ret, ns)
+);
+
+DEFINE_EVENT(io_lab_rw, io_lab_write,
+    TP_PROTO(unsigned int minor, size_t len, ssize_t ret, u64 ns),
+    TP_ARGS(minor, len, ret, ns)
+);
+
+TRACE_EVENT(io_lab_ioctl,
+    TP_PROTO(unsigned int minor, unsigned int cmd, long ret),
+    TP_ARGS(minor, cmd, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%u cmd=%#x ret=%ld",
+              __entry->minor, __entry->cmd, __entry->ret)
+);
+
+#endif /* _IO_LAB_TRACE_H */
+
+/* this header is outside include/trace/events, tell define_trace.h where */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE io_lab_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,106 @@
+/*
+ * Throughput of the mydisk write transform from mydisk_transform.h.
+ *
+ * Every pass copies the incoming data into the segment buffer first, as the
+ * transform works in place; the "copy" line is that copy alone.
+ *
+ * Usage: ./transform [segment_bytes] [total_megabytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../mydisk_transform.h"
+
+typedef void (*transform_fn)(unsigned char *, const unsigned char *, size_t, size_t);
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void copy_only(unsigned char *buf, const unsigned char *old, size_t from, size_t to)
+{
+}
+
+static void run(const char *name, transform_fn fn, const unsigned char *in,
+                const unsigned char *old, unsigned char *buf, size_t len, size_t total)
+{
+    size_t iters = total / len ? total / len : 1;
+    double t0, t1;
+    size_t i;
+
+    t0 = now();
+    for (i = 0; i < iters; i++) {
+        memcpy(buf, in, len);
+        fn(buf, old, 0, len);
+        __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    t1 = now();
+    printf("  %-6s %8.2f GB/s\n", name, (double)iters * len / (t1 - t0) / 1e9);
+}
+
+/* Both versions must agree for any segment and any split into pieces */
+static int check(size_t len)
+{
+    unsigned char *in = malloc(len), *old = malloc(len);
+    unsigned char *a = malloc(len), *b = malloc(len);
+    int round, ok = 1;
+
+    for (round = 0; round < 2000 && ok; round++) {
+        size_t i, from, mid;
+
+        for (i = 0; i < len; i++) {
+            old[i] = rand() % 4;
+            in[i] = round % 3 ? old[i] ^ (rand() % 3 == 0) : rand();
+        }
+        mid = rand() % (len + 1);
+        memcpy(a, in, len);
+        memcpy(b, in, len);
+        mydisk_transform_bytes(a, old, 0, len);
+        for (from = 0; from < len; from = mid, mid = len)
+            mydisk_transform_swar(b, old + from, from, mid);
+        ok = !memcmp(a, b, len);
+    }
+    free(in);
+    free(old);
+    free(a);
+    free(b);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? strtoull(argv[1], NULL, 0) : 4096;
+    size_t total = (argc > 2 ? strtoull(argv[2], NULL, 0) : 1024) << 20;
+    unsigned char *in = malloc(len), *old = malloc(len), *buf = malloc(len);
+    static const char *const names[] = { "new data", "rewrite", "half equal" };
+    size_t i;
+    int w;
+
+    srand(1);
+    if (!check(len < 64 ? len : 64) || !check(len)) {
+        printf("swar and bytes disagree\n");
+        return 1;
+    }
+
+    printf("segment %zu bytes\n", len);
+    for (w = 0; w < 3; w++) {
+        for (i = 0; i < len; i++) {
+            in[i] = rand();
+            old[i] = w == 0 ? 0 : w == 1 ? in[i] : rand() % 2 ? in[i] : 0;
+        }
+        printf("%s\n", names[w]);
+        run("copy", copy_only, in, old, buf, len, total);
+        run("bytes", mydisk_transform_bytes, in, old, buf, len, total);
+        run("swar", mydisk_transform_swar, in, old, buf, len, total);
+    }
+    free(in);
+    free(old);
+    free(buf);
+    return 0;
+}
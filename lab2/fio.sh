@@ -0,0 +1,45 @@
+#!/bin/bash
+# 4K random read/write on the raw disk with 1, 4 and all CPUs as fio jobs,
+# then a single large sequential writer, then one random writer and one
+# random reader per partition at once to load different regions together.
+# Usage: ./fio.sh [device] [seconds]
+if [ "$(whoami)" != "root" ]; then
+  sudo "$0" "$@"
+  exit $?
+fi
+
+DEV=${1:-/dev/mydisk}
+RUNTIME=${2:-10}
+
+for jobs in 1 4 $(nproc); do
+  for rw in randread randwrite; do
+    echo "jobs=$jobs rw=$rw"
+    fio --name=mydisk --filename="$DEV" --rw=$rw --bs=4k --direct=1 \
+        --ioengine=libaio --iodepth=32 --numjobs=$jobs --group_reporting \
+        --time_based --runtime="$RUNTIME" | grep -E "IOPS=|clat \("
+  done
+done
+
+for bs in 1M 4M; do
+  echo "jobs=1 rw=write bs=$bs"
+  fio --name=mydisk --filename="$DEV" --rw=write --bs=$bs --direct=1 \
+      --ioengine=libaio --iodepth=4 --numjobs=1 \
+      --time_based --runtime="$RUNTIME" | grep -E "IOPS=|clat \("
+done
+
+# The extended partition is only a couple of sectors long, skip it.
+NAME=$(basename "$DEV")
+PARTS=()
+for part in /sys/block/"$NAME"/"$NAME"*; do
+  [ "$(cat "$part/size")" -gt 2 ] && PARTS+=("/dev/$(basename "$part")")
+done
+if [ ${#PARTS[@]} -gt 0 ]; then
+  echo "partitions=${PARTS[*]} rw=randrw"
+  args=()
+  for p in "${PARTS[@]}"; do
+    args+=(--name="$(basename "$p")-w" --filename="$p" --rw=randwrite)
+    args+=(--name="$(basename "$p")-r" --filename="$p" --rw=randread)
+  done
+  fio --bs=4k --direct=1 --ioengine=libaio --iodepth=32 --group_reporting \
+      --time_based --runtime="$RUNTIME" "${args[@]}" | grep -E "IOPS=|clat \("
+fi
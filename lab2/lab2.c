@@ -8,11 +8,109 @@
 #include <linux/blkdev.h>
 #include <linux/bio.h>
 #include <linux/string.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/cpumask.h>
+#include <linux/radix-tree.h>
+#include <linux/spinlock.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/crc32.h>
+#include <linux/uuid.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/seqlock.h>
+#include <linux/cache.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/zsmalloc.h>
+#include <linux/lz4.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/file.h>
+#include <linux/bitops.h>
+#include <linux/hrtimer.h>
+
+#include "mydisk_transform.h"
 
 
 /* Variable for Major Number */
 int c = 0;
 
+/*
+ * How I/O reaches the disk: straight from submit_bio() as bios, or as
+ * requests through blk-mq with merging and scheduling.
+ */
+#define MYDISK_Q_BIO 0
+#define MYDISK_Q_MQ  1
+
+static int queue_mode = MYDISK_Q_MQ;
+module_param(queue_mode, int, 0444);
+MODULE_PARM_DESC(queue_mode, "I/O path: 0 - bio based, 1 - blk-mq (default)");
+
+/* Hardware contexts of the queue, 0 means one per online CPU */
+static int nr_hw_queues = 0;
+module_param(nr_hw_queues, int, 0444);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues (default: one per CPU)");
+
+static int hw_queue_depth = 128;
+module_param(hw_queue_depth, int, 0444);
+MODULE_PARM_DESC(hw_queue_depth, "Requests in flight per hardware queue (default: 128)");
+
+/* Every changed byte is written as the average of the three before it */
+static bool write_transform = true;
+module_param(write_transform, bool, 0644);
+MODULE_PARM_DESC(write_transform, "Apply the averaging transform to written data (default: on)");
+
+/* Writes this large are split into chunks transformed on several CPUs */
+static unsigned int offload_kb = 0;
+module_param(offload_kb, uint, 0644);
+MODULE_PARM_DESC(offload_kb, "Spread writes of at least this many KiB over the CPUs, 0 - off (default)");
+
+/* Completions reaped by blk_poll(), see the POLLED COMPLETIONS section */
+static bool io_poll = false;
+module_param(io_poll, bool, 0444);
+MODULE_PARM_DESC(io_poll, "Let RWF_HIPRI submitters poll for blk-mq completions");
+
+static unsigned int poll_irq_us = 10;
+module_param(poll_irq_us, uint, 0644);
+MODULE_PARM_DESC(poll_irq_us, "With io_poll, complete requests nobody polled for after this many us (default: 10)");
+
+/* Store pages LZ4 compressed, see the COMPRESSED STORE section */
+static bool compress = false;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Keep the store LZ4 compressed in a zsmalloc pool");
+
+/* Where the pages of the store come from */
+static int numa_node = NUMA_NO_NODE;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "Allocate the store on this NUMA node only, -1 - anywhere (default)");
+
+static bool numa_interleave = false;
+module_param(numa_interleave, bool, 0444);
+MODULE_PARM_DESC(numa_interleave, "Spread the store over the online nodes in 2 MiB regions");
+
+static bool huge_pages = false;
+module_param(huge_pages, bool, 0444);
+MODULE_PARM_DESC(huge_pages, "Back each written 2 MiB region of the disk with one compound page");
+
+/* Image of the disk kept on a file, see the BACKING FILE section */
+static char *backing_file;
+module_param(backing_file, charp, 0444);
+MODULE_PARM_DESC(backing_file, "Keep the disk in this file across module loads");
+
+static unsigned int writeback_ms = 1000;
+module_param(writeback_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_ms, "Write dirty pages to the backing file this often (default: 1000)");
+
+/* Pages of equal content share one pool object */
+static bool dedup = false;
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "Store pages of equal content once, needs compress");
+
 #define SECTOR_SIZE 512  /* bytes */
 #define MBR_SIZE SECTOR_SIZE
 #define MBR_DISK_SIGNATURE_OFFSET 440
@@ -65,14 +163,11 @@ typedef PartEntry PartTable[4];
 #define HEAD_SIZE (SEC_PER_HEAD * SECTOR_SIZE)
 #define CYL_SIZE (SEC_PER_HEAD * HEAD_PER_CYL * SECTOR_SIZE)
 
-#define sec4size(s) ((((s) % CYL_SIZE) % HEAD_SIZE) / SECTOR_SIZE)
-#define head4size(s) (((s) % CYL_SIZE) / HEAD_SIZE)
-#define cyl4size(s) ((s) / CYL_SIZE)
-
-#define MB2SEC(mb) (mb * 1024 * 1024 / SECTOR_SIZE)
+#define MB2SEC(mb) ((sector_t)(mb) << (20 - 9))
 
 #define PRM 0x83
 #define EXT 0x05
+#define GPT_PROTECTIVE 0xEE
 
 /****************************************************************************************
 * LBA -> CHS & CHS -> LBA
@@ -95,183 +190,408 @@ typedef PartEntry PartTable[4];
 #define HPC HEAD_PER_CYL
 #define SPT SEC_PER_HEAD
 
-#define lba2cyl(lba) ((unsigned char)(lba / (HPC * SPT)))
-#define lba2head(lba) ((unsigned char)((lba / SPT) % HPC))
-#define lba2sec(lba) ((unsigned char)((lba % SPT) + 1))
+/* CHS has 10 bits of cylinder, anything past it is stored as the maximum */
+#define CHS_MAX_LBA (1024 * HPC * SPT)
 
 /****************************************************************************************
  *                           PARTITIONS
- *                               50  <----- MEMSIZE
+ *                               50  <----- disk_size_mb
  *                               / \
- *                PRT1_1 -----> 2 + 48 <----- PRT1_2
+ *               primary -----> 2 + 48 <----- extended
  *                                  /|\
- *                 PRT2_1 -----> 10 18 20 <----- PRT2_3
- *                                   ⋀
- *                        PRT2_3 ____/
+ *                     logical -> 10 18 20
  *
+ * The layout above is the default. The disk size, the primary partitions and the
+ * logical ones inside a single extended partition come from module parameters,
+ * the MBR and the EBR chain (or a GPT) are generated from them at load time.
 *****************************************************************************************/
 
-#define SEC_START 0x1
-
-/*  Size of Ram disk in sectors */
-#define MEMSIZE MB2SEC(50) 
-
-/* Sizes of logical partitions */
-#define PRT1_1 MB2SEC(2)
-#define PRT2_1 MB2SEC(10)
-#define PRT2_2 MB2SEC(18)
-#define PRT2_3 MB2SEC(20)
-
-/* Sizes of extended partitions */
-#define EXTP_1 PRT2_1 + PRT2_2 + PRT2_3
-#define EXTP_2_1 PRT2_2 + PRT2_3
-#define EXTP_2_2 PRT2_3
-
-
-
-static PartTable def_part_table =
-{
-    {
-        boot_type: 0x00,
-        start_sec: (lba2sec(SEC_START) & 0x3F),
-        start_head: lba2head(SEC_START),
-        start_cyl: (lba2cyl(SEC_START) & 0xFF),
-        start_cyl_hi: (lba2cyl(SEC_START) & 0x300),
-        part_type: PRM,
-        end_head: lba2sec(SEC_START + PRT1_1 - 1),
-        end_sec: lba2head(SEC_START + PRT1_1 - 1) & 0x3F,
-        end_cyl: (lba2cyl(SEC_START + PRT1_1 - 1) & 0xFF),
-        end_cyl_hi: (lba2cyl(SEC_START + PRT1_1 - 1) & 0x300),
-        abs_start_sec: SEC_START,
-        sec_in_part: PRT1_1 // 2Mbyte
-    },
-    {
-        boot_type: 0x00,
-        start_head: lba2head(SEC_START + PRT1_1),
-        start_sec: lba2sec(SEC_START + PRT1_1) & 0x3F,
-        start_cyl: lba2cyl(SEC_START + PRT1_1) & 0xFF,
-        start_cyl_hi: lba2cyl(SEC_START + PRT1_1) & 0x300,
-        part_type: EXT, // extended partition type
-        end_sec: lba2sec(SEC_START + PRT1_1 + EXTP_1 - 1),
-        end_head: lba2head(SEC_START + PRT1_1 + EXTP_1 - 1),
-        end_cyl: lba2cyl(SEC_START + PRT1_1 + EXTP_1 - 1) & 0xFF,
-        end_cyl_hi: lba2cyl(SEC_START + PRT1_1 + EXTP_1 - 1) & 0x300,
-        abs_start_sec: PRT1_1 + 1,
-        sec_in_part: EXTP_1 // 48 Mbyte
-    }
+#define MAX_PRIMARY 4
+#define MAX_LOGICAL 16
+
+/* Partitions start on 4 KiB, so filesystem blocks do not straddle pages of the store */
+#define PART_ALIGN 8
+
+static unsigned long disk_size_mb = 50;
+module_param(disk_size_mb, ulong, 0444);
+MODULE_PARM_DESC(disk_size_mb, "Size of the disk in MiB (default: 50)");
+
+static unsigned int primary_mb[MAX_PRIMARY] = { 2 };
+static int nr_primary_mb = 1;
+module_param_array_named(primary, primary_mb, uint, &nr_primary_mb, 0444);
+MODULE_PARM_DESC(primary, "Sizes of primary partitions in MiB, 0 skips an entry (default: 2)");
+
+static unsigned int logical_mb[MAX_LOGICAL] = { 10, 18, 20 };
+static int nr_logical_mb = 3;
+module_param_array_named(logical, logical_mb, uint, &nr_logical_mb, 0444);
+MODULE_PARM_DESC(logical, "Sizes of logical partitions in MiB, 0 skips an entry (default: 10,18,20)");
+
+static bool gpt = false;
+module_param(gpt, bool, 0444);
+MODULE_PARM_DESC(gpt, "Write a GPT instead of an MBR, always done for disks over 2 TiB");
+
+struct mydisk_part
+{
+    sector_t start;     /* first data sector */
+    sector_t count;
+    sector_t br;        /* EBR of a logical partition */
 };
-static unsigned int def_log_part_br_abs_start_sector[] = {(PRT1_1 + 1), (PRT1_1 + PRT2_1 + 1), (PRT1_1 + PRT2_1 + PRT2_2 + 1)};
-static const PartTable def_log_part_table[] =
+
+/* Where the partitions go, computed once by mydisk_plan() */
+static struct
+{
+    bool gpt;
+    int nr_primary;
+    int nr_logical;     /* follow the primary ones in part[] */
+    struct mydisk_part part[MAX_PRIMARY + MAX_LOGICAL];
+} layout;
+
+/****************************************************************************************
+ *                           GPT
+ * LBA 0 protective MBR, LBA 1 header, LBA 2..33 entries, partitions, then the backup
+ * entries and the backup header in the last 33 sectors.
+*****************************************************************************************/
+
+#define GPT_SIGNATURE 0x5452415020494645ULL /* "EFI PART" */
+#define GPT_REVISION 0x00010000
+#define GPT_ENTRIES 128
+#define GPT_ENTRY_SIZE 128
+#define GPT_ENTRIES_SECTORS (GPT_ENTRIES * GPT_ENTRY_SIZE / SECTOR_SIZE)
+#define GPT_FIRST_USABLE (2 + GPT_ENTRIES_SECTORS)
+
+typedef struct
+{
+    __le64 signature;
+    __le32 revision;
+    __le32 header_size;
+    __le32 header_crc32;
+    __le32 reserved;
+    __le64 my_lba;
+    __le64 alternate_lba;
+    __le64 first_usable_lba;
+    __le64 last_usable_lba;
+    guid_t disk_guid;
+    __le64 partition_entry_lba;
+    __le32 num_partition_entries;
+    __le32 sizeof_partition_entry;
+    __le32 partition_entry_array_crc32;
+} __packed GptHeader;
+
+typedef struct
 {
+    guid_t type;
+    guid_t uuid;
+    __le64 first_lba;
+    __le64 last_lba;
+    __le64 attributes;
+    __le16 name[36];
+} __packed GptEntry;
+
+/* Linux filesystem data */
+static const guid_t gpt_linux_data =
+    GUID_INIT(0x0FC63DAF, 0x8483, 0x4772, 0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4);
+
+/* Place one partition at or after *next, the last one may be cut to fit */
+static int mydisk_plan_part(struct mydisk_part *p, sector_t *next, sector_t end,
+                            unsigned int mb, sector_t br_size)
+{
+    sector_t start = ALIGN(*next, PART_ALIGN);
+
+    p->br = start;
+    start += br_size;
+    if (start >= end)
     {
-        {
-            boot_type: 0x00,
-            start_sec: lba2sec(SEC_START)  & 0x3F,
-            start_head: lba2head(SEC_START),
-            start_cyl: lba2cyl(SEC_START) & 0xFF,
-            start_cyl_hi: lba2cyl(SEC_START) & 0x300,
-            part_type: PRM,
-            end_head: lba2sec(SEC_START + PRT2_1 - 1),
-            end_sec: lba2head(SEC_START + PRT2_1 - 1)  & 0x3F,
-            end_cyl: lba2cyl(SEC_START + PRT2_1 - 1) & 0xFF,
-            end_cyl_hi: lba2cyl(SEC_START + PRT2_1 - 1) & 0x300,
-            abs_start_sec: SEC_START,
-            sec_in_part: PRT2_1 // 10 Mb
-        },
-        {
-            boot_type: 0x00,
-            start_head: lba2head(SEC_START + PRT2_1),
-            start_sec: lba2sec(SEC_START + PRT2_1)  & 0x3F,
-            start_cyl: lba2cyl(SEC_START + PRT2_1) & 0xFF,
-            start_cyl_hi: lba2cyl(SEC_START + PRT2_1) & 0x300,
-            part_type: EXT,
-            end_head: lba2head(SEC_START + PRT2_1 + EXTP_2_1 - 1),
-            end_sec: lba2head(SEC_START + PRT2_1 + EXTP_2_1 - 1)  & 0x3F,
-            end_cyl: lba2cyl(SEC_START + PRT2_1 + EXTP_2_1 - 1) & 0xFF,
-            end_cyl_hi: lba2cyl(SEC_START + PRT2_1 + EXTP_2_1 - 1) & 0x300,
-            abs_start_sec: PRT2_1,
-            sec_in_part: PRT2_2 + 1  // 38 Mb
-        }
-    },
+        printk(KERN_ERR "mydisk: partitions do not fit into %lu MiB\n", disk_size_mb);
+        return -EINVAL;
+    }
+    p->start = start;
+    p->count = min_t(sector_t, MB2SEC(mb), end - start);
+    /*
+     * Sizes that add up to the disk, the default 2 + 10 + 18 + 20 of 50 MiB
+     * among them, lose the sectors of the tables and of alignment from the
+     * last partition, as the fixed layout always did. Only a partition cut
+     * by a MiB or more means the sizes asked for do not fit.
+     */
+    if (p->count + MB2SEC(1) <= MB2SEC(mb))
+        printk(KERN_INFO "mydisk: last partition cut to %llu sectors\n",
+               (unsigned long long)p->count);
+    *next = start + p->count;
+    return 0;
+}
+
+/* Lay out the partitions of a capacity sectors long disk */
+static int mydisk_plan(sector_t capacity)
+{
+    sector_t next, end;
+    int i, ret;
+
+    memset(&layout, 0, sizeof(layout));
+    layout.gpt = gpt;
+    if (!gpt && capacity > U32_MAX)
     {
-        {
-            boot_type: 0x00,
-            start_sec: lba2sec(SEC_START) & 0x3F,
-            start_head: lba2head(SEC_START),
-            start_cyl: lba2cyl(SEC_START) & 0xFF,
-            start_cyl_hi: lba2cyl(SEC_START) & 0x300,
-            part_type: PRM,
-            end_head: lba2sec(SEC_START + PRT2_2 - 1),
-            end_sec: lba2head(SEC_START + PRT2_2 - 1) & 0x3F,
-            end_cyl: lba2cyl(SEC_START + PRT2_2 - 1) & 0xFF,
-            end_cyl_hi: lba2cyl(SEC_START + PRT2_2 - 1) & 0x300,
-            abs_start_sec: SEC_START,
-            sec_in_part: PRT2_2 // 18 Mb
-        },
-        {
-            boot_type: 0x00,
-            start_head: lba2head(SEC_START + PRT2_2),
-            start_sec: lba2sec(SEC_START + PRT2_2) & 0x3F,
-            start_cyl: lba2cyl(SEC_START + PRT2_2) & 0xFF,
-            start_cyl_hi: lba2cyl(SEC_START + PRT2_2) & 0x300,
-            part_type: EXT,
-            end_head: lba2head(SEC_START + PRT2_2 + EXTP_2_2 - 1),
-            end_sec: lba2head(SEC_START + PRT2_2 + EXTP_2_2 - 1) & 0x3F,
-            end_cyl: lba2cyl(SEC_START + PRT2_2 + EXTP_2_2 - 1) & 0xFF,
-            end_cyl_hi: lba2cyl(SEC_START + PRT2_2 + EXTP_2_2 - 1) & 0x300,
-            abs_start_sec: PRT2_2 + PRT2_1,
-            sec_in_part: PRT2_3 + 1 // 20 Mb
-        }
-    },
+        printk(KERN_INFO "mydisk: disk is too large for MBR, using GPT\n");
+        layout.gpt = true;
+    }
+    if (layout.gpt)
     {
-        {
-            boot_type: 0x00,
-            start_sec: lba2sec(SEC_START) & 0x3F,
-            start_head: lba2head(SEC_START),
-            start_cyl: lba2cyl(SEC_START) & 0xFF,
-            start_cyl_hi: lba2cyl(SEC_START) & 0x300,
-            part_type: PRM,
-            end_head: lba2sec(SEC_START + PRT2_3 - 1),
-            end_sec: lba2head(SEC_START + PRT2_3 - 1) & 0x3F,
-            end_cyl: lba2cyl(SEC_START + PRT2_3 - 1) & 0xFF,
-            end_cyl_hi: lba2cyl(SEC_START + PRT2_3 - 1) & 0x300,
-            abs_start_sec: SEC_START,
-            sec_in_part: PRT2_3 // 20 Mb
-        }
+        if (capacity <= 2 * GPT_FIRST_USABLE)
+            return -EINVAL;
+        next = GPT_FIRST_USABLE;
+        end = capacity - GPT_FIRST_USABLE + 1;
     }
-};
+    else
+    {
+        next = 1;
+        end = capacity;
+    }
+
+    for (i = 0; i < nr_primary_mb; i++)
+    {
+        if (!primary_mb[i])
+            continue;
+        ret = mydisk_plan_part(&layout.part[layout.nr_primary], &next, end, primary_mb[i], 0);
+        if (ret)
+            return ret;
+        layout.nr_primary++;
+    }
+    /* GPT has no extended partition, every logical one becomes a plain entry */
+    for (i = 0; i < nr_logical_mb; i++)
+    {
+        if (!logical_mb[i])
+            continue;
+        ret = mydisk_plan_part(&layout.part[layout.nr_primary + layout.nr_logical], &next, end,
+                               logical_mb[i], layout.gpt ? 0 : PART_ALIGN);
+        if (ret)
+            return ret;
+        layout.nr_logical++;
+    }
+    /* counted as laid out, 0 entries of the parameters take no slot */
+    if (!layout.gpt && layout.nr_logical && layout.nr_primary == MAX_PRIMARY)
+    {
+        printk(KERN_ERR "mydisk: at most %d primary partitions fit next to the extended one\n",
+               MAX_PRIMARY - 1);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Minors for the whole disk and its highest partition number */
+static int mydisk_minors(void)
+{
+    if (layout.gpt)
+        return 1 + layout.nr_primary + layout.nr_logical;
+    /* logical partitions are numbered from 5 */
+    return 1 + (layout.nr_logical ? 4 + layout.nr_logical : layout.nr_primary);
+}
+
+static void lba2chs(sector_t lba, unsigned int *cyl, unsigned char *head, unsigned char *sec)
+{
+    u32 l;
+
+    if (lba >= CHS_MAX_LBA)
+    {
+        *cyl = 1023;
+        *head = HPC - 1;
+        *sec = SPT;
+        return;
+    }
+    l = lba;
+    *cyl = l / (HPC * SPT);
+    *head = (l / SPT) % HPC;
+    *sec = (l % SPT) + 1;
+}
+
+/* Entry for sectors [start, start + count), its LBA is relative to base */
+static void fill_entry(PartEntry *e, unsigned char type, sector_t start, sector_t count, sector_t base)
+{
+    unsigned int cyl;
+    unsigned char head, sec;
+
+    memset(e, 0, sizeof(*e));
+    e->boot_type = 0x00;
+    e->part_type = type;
+
+    lba2chs(start, &cyl, &head, &sec);
+    e->start_head = head;
+    e->start_sec = sec & 0x3F;
+    e->start_cyl = cyl & 0xFF;
+    e->start_cyl_hi = (cyl >> 8) & 0x3;
+
+    lba2chs(start + count - 1, &cyl, &head, &sec);
+    e->end_head = head;
+    e->end_sec = sec & 0x3F;
+    e->end_cyl = cyl & 0xFF;
+    e->end_cyl_hi = (cyl >> 8) & 0x3;
+
+    e->abs_start_sec = start - base;
+    e->sec_in_part = count;
+}
+
+static int mydisk_store(const u8 *src, sector_t sector, unsigned int len);
 
-static void copy_mbr(u8 *disk)
+static void copy_mbr(u8 *disk, sector_t capacity)
 {
+    PartEntry *table = (PartEntry *)(disk + PARTITION_TABLE_OFFSET);
+    const struct mydisk_part *first, *last;
+    int i;
+
     memset(disk, 0x0, MBR_SIZE);
-    *(unsigned long *)(disk + MBR_DISK_SIGNATURE_OFFSET) = 0x36E5756D;
-    memcpy(disk + PARTITION_TABLE_OFFSET, &def_part_table, PARTITION_TABLE_SIZE);
+    *(u32 *)(disk + MBR_DISK_SIGNATURE_OFFSET) = 0x36E5756D;
+    if (layout.gpt)
+    {
+        fill_entry(&table[0], GPT_PROTECTIVE, 1, min_t(sector_t, capacity - 1, U32_MAX), 0);
+    }
+    else
+    {
+        for (i = 0; i < layout.nr_primary; i++)
+            fill_entry(&table[i], PRM, layout.part[i].start, layout.part[i].count, 0);
+        if (layout.nr_logical)
+        {
+            /* the extended partition spans all EBRs and logical partitions */
+            first = &layout.part[layout.nr_primary];
+            last = &layout.part[layout.nr_primary + layout.nr_logical - 1];
+            fill_entry(&table[i], EXT, first->br, last->start + last->count - first->br, 0);
+        }
+    }
     *(unsigned short *)(disk + MBR_SIGNATURE_OFFSET) = MBR_SIGNATURE;
 }
-static void copy_br(u8 *disk, int abs_start_sector, const PartTable *part_table)
+
+/*
+ * EBR of logical partition n: the partition relative to this EBR, and the
+ * next EBR relative to the start of the extended partition.
+ */
+static void copy_br(u8 *disk, int n)
 {
-    disk += (abs_start_sector * SECTOR_SIZE);
+    PartEntry *table = (PartEntry *)(disk + PARTITION_TABLE_OFFSET);
+    const struct mydisk_part *ext = &layout.part[layout.nr_primary];
+    const struct mydisk_part *p = ext + n;
+
     memset(disk, 0x0, BR_SIZE);
-    memcpy(disk + PARTITION_TABLE_OFFSET, part_table,
-        PARTITION_TABLE_SIZE);
+    fill_entry(&table[0], PRM, p->start, p->count, p->br);
+    if (n + 1 < layout.nr_logical)
+        fill_entry(&table[1], EXT, p[1].br, p[1].start + p[1].count - p[1].br, ext->br);
     *(unsigned short *)(disk + BR_SIGNATURE_OFFSET) = BR_SIGNATURE;
 }
-void copy_mbr_n_br(u8 *disk)
+
+static u32 gpt_crc32(const void *buf, size_t len)
 {
-    int i;
+    return crc32_le(~0U, buf, len) ^ ~0U;
+}
+
+static int copy_gpt(sector_t capacity)
+{
+    sector_t backup = capacity - 1;
+    u8 sector[SECTOR_SIZE];
+    GptHeader *h = (GptHeader *)sector;
+    GptEntry *e;
+    int i, ret;
+
+    e = kcalloc(GPT_ENTRIES, GPT_ENTRY_SIZE, GFP_KERNEL);
+    if (!e)
+        return -ENOMEM;
+    for (i = 0; i < layout.nr_primary + layout.nr_logical; i++)
+    {
+        e[i].type = gpt_linux_data;
+        guid_gen(&e[i].uuid);
+        e[i].first_lba = cpu_to_le64(layout.part[i].start);
+        e[i].last_lba = cpu_to_le64(layout.part[i].start + layout.part[i].count - 1);
+    }
+
+    memset(sector, 0, sizeof(sector));
+    h->signature = cpu_to_le64(GPT_SIGNATURE);
+    h->revision = cpu_to_le32(GPT_REVISION);
+    h->header_size = cpu_to_le32(sizeof(*h));
+    h->first_usable_lba = cpu_to_le64(GPT_FIRST_USABLE);
+    h->last_usable_lba = cpu_to_le64(capacity - GPT_FIRST_USABLE);
+    guid_gen(&h->disk_guid);
+    h->num_partition_entries = cpu_to_le32(GPT_ENTRIES);
+    h->sizeof_partition_entry = cpu_to_le32(GPT_ENTRY_SIZE);
+    h->partition_entry_array_crc32 = cpu_to_le32(gpt_crc32(e, GPT_ENTRIES * GPT_ENTRY_SIZE));
+
+    /* primary copy right after the MBR */
+    h->my_lba = cpu_to_le64(1);
+    h->alternate_lba = cpu_to_le64(backup);
+    h->partition_entry_lba = cpu_to_le64(2);
+    h->header_crc32 = cpu_to_le32(gpt_crc32(h, sizeof(*h)));
+    ret = mydisk_store(sector, 1, SECTOR_SIZE);
+    if (!ret)
+        ret = mydisk_store((u8 *)e, 2, GPT_ENTRIES * GPT_ENTRY_SIZE);
+
+    /* backup copy at the very end, entries first */
+    h->my_lba = cpu_to_le64(backup);
+    h->alternate_lba = cpu_to_le64(1);
+    h->partition_entry_lba = cpu_to_le64(backup - GPT_ENTRIES_SECTORS);
+    h->header_crc32 = 0;
+    h->header_crc32 = cpu_to_le32(gpt_crc32(h, sizeof(*h)));
+    if (!ret)
+        ret = mydisk_store((u8 *)e, backup - GPT_ENTRIES_SECTORS, GPT_ENTRIES * GPT_ENTRY_SIZE);
+    if (!ret)
+        ret = mydisk_store(sector, backup, SECTOR_SIZE);
+
+    kfree(e);
+    return ret;
+}
+
+/* Write the MBR and the EBR chain or the GPT, only their sectors get backing pages */
+int copy_mbr_n_br(sector_t capacity)
+{
+    u8 sector[SECTOR_SIZE];
+    int i, ret;
 
-    copy_mbr(disk);
-    for (i = 0; i < ARRAY_SIZE(def_log_part_table); i++)
+    copy_mbr(sector, capacity);
+    ret = mydisk_store(sector, 0, SECTOR_SIZE);
+    if (ret)
+        return ret;
+    if (layout.gpt)
+        return copy_gpt(capacity);
+    for (i = 0; !ret && i < layout.nr_logical; i++)
     {
-        copy_br(disk, def_log_part_br_abs_start_sector[i], &def_log_part_table[i]);
+        copy_br(sector, i);
+        ret = mydisk_store(sector, layout.part[layout.nr_primary + i].br, SECTOR_SIZE);
     }
+    return ret;
 }
+
+/*
+ * Data in the store is guarded per stripe of pages, page N belongs to stripe
+ * N % MYDISK_STRIPES, so neighbouring pages and distant regions never share
+ * a lock. Writers and discards take the stripe lock and bump seq, readers
+ * take no lock and retry their copy if seq moved under them.
+ */
+#define MYDISK_STRIPES 64
+
+struct mydisk_stripe
+{
+    spinlock_t lock;
+    seqcount_t seq;
+} ____cacheline_aligned_in_smp;
+
 /* Structure associated with Block device */
 struct mydiskdrive_dev 
 {
-    int size;
-    u8 *data;
+    sector_t size;
+    /*
+     * Backing store: pages indexed by page number of the disk, allocated on
+     * first write. Lookups run under RCU, lock only orders changes to the
+     * tree itself; freed pages wait for an RCU grace period. An entry is a
+     * struct page or, with compress, a tagged pool handle.
+     */
     spinlock_t lock;
+    struct radix_tree_root pages;
+    /*
+     * While a snapshot exists its pages stay here frozen and pages is an
+     * overlay on top: a hole in pages reads through to base, a zero fill
+     * entry hides the page below it.
+     */
+    struct radix_tree_root base;
+    struct mydisk_stripe stripes[MYDISK_STRIPES];
+    /* for mm_stat */
+    atomic64_t nr_pages;    /* plain pages in the tree */
+    atomic64_t nr_zpages;   /* compressed pages in the pool, shared ones too */
+    atomic64_t compr_size;  /* bytes they take in the pool */
+    atomic64_t nr_same;     /* same-filled pages kept as their byte */
+    atomic64_t nr_dup;      /* pages sharing the pool object of another one */
+    struct blk_mq_tag_set tag_set;
     struct request_queue *queue;
     struct gendisk *gd;
 
@@ -300,142 +620,2265 @@ static struct block_device_operations fops =
     .release = my_release,
 };
 
-int mydisk_init(void)
+#define PAGE_SECTORS_SHIFT (PAGE_SHIFT - 9)
+#define PAGE_SECTORS (1 << PAGE_SECTORS_SHIFT)
+
+static struct mydisk_stripe *mydisk_stripe(pgoff_t idx)
 {
-    (device.data) = vmalloc(MEMSIZE * SECTOR_SIZE);
-    /* Setup its partition table */
-    copy_mbr_n_br(device.data);
+    return &device.stripes[idx % MYDISK_STRIPES];
+}
 
-    return MEMSIZE;	
+static void mydisk_stripe_lock(struct mydisk_stripe *st)
+{
+    spin_lock(&st->lock);
+    write_seqcount_begin(&st->seq);
 }
 
-static int rb_transfer(struct request *req)
+static void mydisk_stripe_unlock(struct mydisk_stripe *st)
 {
-    int dir = rq_data_dir(req);
-    int ret = 0;
-    /*starting sector
-     *where to do operation*/
-    sector_t start_sector = blk_rq_pos(req);
-    unsigned int sector_cnt = blk_rq_sectors(req); /* no of sector on which opn to be done*/
-    struct bio_vec bv;
-    #define BV_PAGE(bv) ((bv).bv_page)
-    #define BV_OFFSET(bv) ((bv).bv_offset)
-    #define BV_LEN(bv) ((bv).bv_len)
-    struct req_iterator iter;
-    sector_t sector_offset;
-    unsigned int sectors;
-    u8 *buffer;
-    sector_offset = 0;
-    rq_for_each_segment(bv, req, iter)
+    write_seqcount_end(&st->seq);
+    spin_unlock(&st->lock);
+}
+
+/* lockless readers may still be copying from the page */
+static void mydisk_free_page_rcu(struct rcu_head *head)
+{
+    __free_page(container_of(head, struct page, rcu_head));
+}
+
+#define MYDISK_HUGE_ORDER (21 - PAGE_SHIFT)     /* 2 MiB */
+#define MYDISK_HUGE_PAGES (1UL << MYDISK_HUGE_ORDER)
+
+static void mydisk_free_huge_rcu(struct rcu_head *head)
+{
+    struct page *page = container_of(head, struct page, rcu_head);
+
+    /* the count dropped to zero in mydisk_put_huge(), __free_pages() wants the last one */
+    set_page_count(page, 1);
+    __free_pages(page, MYDISK_HUGE_ORDER);
+}
+
+/*
+ * A subpage of a compound page has no rcu_head of its own, the field holds
+ * its compound_head. So the head counts its subpages in the tree and only
+ * the whole compound page goes through RCU, once the last one is gone.
+ */
+static void mydisk_put_huge(struct page *head)
+{
+    if (page_ref_dec_and_test(head))
+        call_rcu(&head->rcu_head, mydisk_free_huge_rcu);
+}
+
+/* Node of the store page idx, NUMA_NO_NODE leaves it to the task's policy */
+static int mydisk_page_node(pgoff_t idx)
+{
+    int node, n;
+
+    if (!numa_interleave)
+        return numa_node;
+    /* by whole 2 MiB regions, so a compound page is never split between nodes */
+    n = (idx >> MYDISK_HUGE_ORDER) % num_online_nodes();
+    for (node = first_online_node; n && node < MAX_NUMNODES; n--)
+        node = next_online_node(node);
+    return node < MAX_NUMNODES ? node : NUMA_NO_NODE;
+}
+
+static struct page *mydisk_alloc_page(pgoff_t idx, gfp_t gfp, unsigned int order)
+{
+    int node = mydisk_page_node(idx);
+
+    if (node == NUMA_NO_NODE)
+        return alloc_pages(gfp, order);
+    /* a bound store stays on its node, an interleaved one may spill over */
+    if (!numa_interleave)
+        gfp |= __GFP_THISNODE;
+    return alloc_pages_node(node, gfp, order);
+}
+
+/*
+ * Entries other than struct page are exceptional entries. Pool handles are
+ * word aligned, so the bit above the exceptional one tells them from the
+ * byte of a same-filled page, which is kept in the entry itself.
+ */
+#define MYDISK_FILL_TAG 4UL
+
+static bool mydisk_is_page(void *entry)
+{
+    return entry && !radix_tree_exceptional_entry(entry);
+}
+
+static bool mydisk_is_zentry(void *entry)
+{
+    return radix_tree_exceptional_entry(entry) && !((unsigned long)entry & MYDISK_FILL_TAG);
+}
+
+static bool mydisk_is_fill(void *entry)
+{
+    return radix_tree_exceptional_entry(entry) && ((unsigned long)entry & MYDISK_FILL_TAG);
+}
+
+static void *mydisk_fill_entry(u8 value)
+{
+    return (void *)(((unsigned long)value << 3) | MYDISK_FILL_TAG | RADIX_TREE_EXCEPTIONAL_ENTRY);
+}
+
+static u8 mydisk_fill_byte(void *entry)
+{
+    return (unsigned long)entry >> 3;
+}
+
+/* The byte all of the page is filled with, -1 if there is none */
+static int mydisk_same_filled(const u8 *data)
+{
+    const unsigned long *word = (const unsigned long *)data;
+    unsigned long v = word[0];
+    unsigned int i;
+
+    if (v != REPEAT_BYTE(v & 0xff))
+        return -1;
+    for (i = 1; i < PAGE_SIZE / sizeof(*word); i++)
     {
-        buffer = page_address(BV_PAGE(bv)) + BV_OFFSET(bv);
-        if (BV_LEN(bv) % (SECTOR_SIZE) != 0)
-        {
-            printk(KERN_ERR"bio size is not a multiple ofsector size\n");
-            ret = -EIO;
-        }
-        sectors = BV_LEN(bv) / SECTOR_SIZE;
-        // printk(KERN_DEBUG "my disk: Start Sector: %llu, Sector Offset: %llu;
-        // Buffer: %p; Length: %u sectors\n",
-        // (unsigned long long)(start_sector), (unsigned long long) 
-        // (sector_offset), buffer, sectors);
+        if (word[i] != v)
+            return -1;
+    }
+    return v & 0xff;
+}
 
-        if (dir == WRITE) /* Write to the device */
-        {
-            u8 *device_data = (device.data) + ((start_sector + sector_offset) * SECTOR_SIZE);
-            int i;
-            for (i = 0; i < sectors * SECTOR_SIZE; i++) {
-                if(device_data[i] != buffer[i]) {
-                    // if(buffer[i] == 0xa){
-                    // 	buffer[i] = device_data[i]
-                    // 	continue;
-                    // }
-                    pr_debug("Writing");
-                    if (i < 3)
-                    {
-                        /* Copy the first three bytes unchanged */
-                        pr_info("Writing first 3 bytes: %hhx", buffer[i]);
-                    } 
-                    else 
-                    {
-                        /* Calculate the new byte as the arithmetic average of the three previous bytes */
-                        buffer[i] = DIV_ROUND_CLOSEST(buffer[i-3] + buffer[i-2] + buffer[i-1], 3);
-                        pr_info("Writing average 3 bytes: avg(%hhx,%hhx,%hhx) = %hhx", buffer[i-3], buffer[i-2], buffer[i-1], buffer[i]);
-                    }
-                }
-            }
-            memcpy(device_data\
-            ,buffer,sectors*SECTOR_SIZE);		
-        }
-        else /* Read from the device */
+static void *mydisk_zentry(unsigned long handle)
+{
+    return (void *)(handle | RADIX_TREE_EXCEPTIONAL_ENTRY);
+}
+
+static unsigned long mydisk_zhandle(void *entry)
+{
+    return (unsigned long)entry & ~(unsigned long)RADIX_TREE_EXCEPTIONAL_ENTRY;
+}
+
+static void mydisk_copy_out(void *entry, u8 *dst, unsigned int off, unsigned int n);
+static void mydisk_free_entry(void *entry);
+static void mydisk_mark_dirty(sector_t sector, sector_t nr_sects);
+
+/* Store entry of page idx, NULL for a hole that was never written */
+static void *mydisk_lookup(pgoff_t idx)
+{
+    void *entry;
+
+    rcu_read_lock();
+    entry = radix_tree_lookup(&device.pages, idx);
+    rcu_read_unlock();
+    return entry;
+}
+
+static void *mydisk_lookup_base(pgoff_t idx)
+{
+    void *entry;
+
+    rcu_read_lock();
+    entry = radix_tree_lookup(&device.base, idx);
+    rcu_read_unlock();
+    return entry;
+}
+
+/* Entry page idx reads from, on the disk or on the snapshot */
+static void *mydisk_lookup_view(pgoff_t idx, bool snap)
+{
+    void *entry = snap ? NULL : mydisk_lookup(idx);
+
+    return entry ? entry : mydisk_lookup_base(idx);
+}
+
+/* How a zero page is kept: a hole, unless that shows a snapshot page through */
+static void *mydisk_zero_entry(pgoff_t idx)
+{
+    return mydisk_lookup_base(idx) ? mydisk_fill_entry(0) : NULL;
+}
+
+/* Page holding sector, NULL if it is not a plain page */
+static struct page *mydisk_lookup_page(sector_t sector)
+{
+    void *entry = mydisk_lookup(sector >> PAGE_SECTORS_SHIFT);
+
+    return mydisk_is_page(entry) ? entry : NULL;
+}
+
+/*
+ * Put page at idx, unless a parallel writer got there first, then its page
+ * is returned instead. A same-filled page gets its bytes back and a page of
+ * the snapshot is copied up, the stripe lock is taken for that. NULL if the
+ * tree has no memory for it.
+ */
+static struct page *mydisk_install_page(pgoff_t idx, struct page *page)
+{
+    struct mydisk_stripe *st = mydisk_stripe(idx);
+    void *entry, *view;
+    u8 *data;
+
+    if (radix_tree_preload(GFP_NOIO))
+        return NULL;
+
+    mydisk_stripe_lock(st);
+    entry = mydisk_lookup(idx);
+    if (mydisk_is_page(entry))
+    {
+        page = entry;
+    }
+    else
+    {
+        /* the page gets what it read as, a same-filled byte or the snapshot's copy */
+        view = entry ? entry : mydisk_lookup_base(idx);
+        if (view)
         {
-            memcpy(buffer,(device.data)+((start_sector+sector_offset)\
-            *SECTOR_SIZE),sectors*SECTOR_SIZE);	
+            data = kmap_atomic(page);
+            mydisk_copy_out(view, data, 0, PAGE_SIZE);
+            kunmap_atomic(data);
         }
-        sector_offset += sectors;
+        if (entry)
+            atomic64_dec(&device.nr_same);
+        page->index = idx;
+        spin_lock(&device.lock);
+        if (entry)
+            radix_tree_delete(&device.pages, idx);
+        radix_tree_insert(&device.pages, idx, page);
+        spin_unlock(&device.lock);
+        atomic64_inc(&device.nr_pages);
     }
-    
-    if (sector_offset != sector_cnt)
+    mydisk_stripe_unlock(st);
+    radix_tree_preload_end();
+    return page;
+}
+
+/* Nothing of the overlay in the 2 MiB region starting at first */
+static bool mydisk_region_empty(pgoff_t first)
+{
+    struct radix_tree_iter iter;
+    void __rcu **slot;
+    bool empty = true;
+
+    rcu_read_lock();
+    radix_tree_for_each_slot(slot, &device.pages, &iter, first)
     {
-        printk(KERN_ERR "mydisk: bio info doesn't match with the request info");
-        ret = -EIO;
+        if (radix_tree_deref_retry(radix_tree_deref_slot(slot)))
+        {
+            slot = radix_tree_iter_retry(&iter);
+            continue;
+        }
+        empty = iter.index >= first + MYDISK_HUGE_PAGES;
+        break;
     }
-    return ret;
+    rcu_read_unlock();
+    return empty;
 }
-/** request handling function**/
-static void dev_request(struct request_queue *q)
+
+/*
+ * With huge_pages the first write to an empty 2 MiB region backs all of it
+ * with one compound page, so a large copy stays within one TLB entry of the
+ * linear map instead of touching one per scattered 4K page. Regions that are
+ * already partly there, or a failed order 9 allocation, fall back to 4K
+ * pages. The head holds a reference for each subpage in the tree and one
+ * while they are installed.
+ */
+static struct page *mydisk_insert_huge(pgoff_t idx)
 {
-    struct request *req;
-    int error;
-    while ((req = blk_fetch_request(q)) != NULL) /*check active request 
-                              *for data transfer*/
+    pgoff_t first = round_down(idx, MYDISK_HUGE_PAGES);
+    struct page *head, *sub, *got, *page = NULL;
+    unsigned long i;
+
+    if (!mydisk_region_empty(first))
+        return NULL;
+    head = mydisk_alloc_page(first, GFP_NOIO | __GFP_ZERO | __GFP_HIGHMEM | __GFP_COMP |
+                             __GFP_NORETRY | __GFP_NOWARN, MYDISK_HUGE_ORDER);
+    if (!head)
+        return NULL;
+    for (i = 0; i < MYDISK_HUGE_PAGES; i++)
     {
-    error=rb_transfer(req);// transfer the request for operation
-        __blk_end_request_all(req, error); // end the request
+        sub = head + i;
+        page_ref_inc(head);
+        got = mydisk_install_page(first + i, sub);
+        if (got != sub)
+            page_ref_dec(head);
+        if (first + i == idx)
+            page = got;
     }
+    mydisk_put_huge(head);
+    return page;
 }
 
-void device_setup(void)
+/* Plain page for sector, allocated if there is none */
+static struct page *mydisk_insert_page(sector_t sector)
 {
-    mydisk_init();
-    c = register_blkdev(c, "mydisk");// major no. allocation
-    printk(KERN_ALERT "Major Number is : %d",c);
-    spin_lock_init(&device.lock); // lock for queue
-    device.queue = blk_init_queue( dev_request, &device.lock); 
-
-    device.gd = alloc_disk(8); // gendisk allocation
-    
-    (device.gd)->major=c; // major no to gendisk
-    device.gd->first_minor=0; // first minor of gendisk
+    pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+    struct page *page, *got;
 
-    device.gd->fops = &fops;
-    device.gd->private_data = &device;
-    device.gd->queue = device.queue;
-    device.size= mydisk_init();
-    printk(KERN_INFO"THIS IS DEVICE SIZE %d",device.size);	
-    sprintf(((device.gd)->disk_name), "mydisk");
-    set_capacity(device.gd, device.size);  
-    add_disk(device.gd);
-}
+    page = mydisk_lookup_page(sector);
+    if (page)
+        return page;
+    if (huge_pages)
+    {
+        page = mydisk_insert_huge(idx);
+        if (page)
+            return page;
+    }
 
-static int __init mydiskdrive_init(void)
-{	
-    int ret=0;
-    device_setup();
-    
-    return ret;
+    page = mydisk_alloc_page(idx, GFP_NOIO | __GFP_ZERO | __GFP_HIGHMEM, 0);
+    if (!page)
+        return NULL;
+    got = mydisk_install_page(idx, page);
+    if (got != page)
+        __free_page(page);
+    return got;
 }
 
-void mydisk_cleanup(void)
+/*
+ * Allocate pages under [sector, sector + len) before writing there. It may
+ * sleep, so it runs before the bvec is mapped.
+ */
+static int mydisk_setup_pages(sector_t sector, unsigned int len)
 {
-    vfree(device.data);
-}
+    unsigned int off = (sector & (PAGE_SECTORS - 1)) << 9;
+    unsigned int done = 0;
 
-void __exit mydiskdrive_exit(void)
-{
+    /* compressed writes allocate for themselves */
+    if (compress)
+        return 0;
+    while (done < len)
+    {
+        unsigned int n = min_t(unsigned int, len - done, PAGE_SIZE - off);
+
+        if (!mydisk_insert_page(sector))
+            return -ENOSPC;
+        done += n;
+        sector += n >> 9;
+        off = 0;
+    }
+    return 0;
+}
+
+/****************************************************************************************
+ *                           COMPRESSED STORE
+ * With compress=1 every page is LZ4 compressed on write and kept in a zsmalloc pool,
+ * its tree entry is the tagged pool handle. A page that does not shrink below MYDISK_ZMAX
+ * stays a plain page, a same-filled one becomes a fill entry. Pool objects are freed at
+ * once, so they are only read under the stripe lock, and a partial write decompresses
+ * the page, patches it and compresses it again, all in the per-CPU buffers of
+ * mydisk_zstream.
+ *
+ * With dedup=1 objects are also indexed by a hash of their LZ4 data. LZ4 output depends
+ * on the input only, so a page equal to a stored one compresses to the same bytes and
+ * takes a reference on that object instead of a new one. Objects are never written in
+ * place, so a write to a shared page simply moves it to a new object.
+*****************************************************************************************/
+
+#if IS_ENABLED(CONFIG_ZSMALLOC) && IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+
+/* an object is this header followed by the LZ4 data */
+struct mydisk_zhdr
+{
+    u32 hash;   /* of the LZ4 data, with dedup */
+    u16 len;    /* of the LZ4 data */
+    u16 shared; /* indexed in mydisk_dedup */
+};
+
+#define MYDISK_ZHDR sizeof(struct mydisk_zhdr)
+/* larger objects save too little to be worth a decompression per read */
+#define MYDISK_ZMAX (PAGE_SIZE * 3 / 4)
+
+struct mydisk_zstream
+{
+    u8 wrkmem[LZ4_MEM_COMPRESS] __aligned(8);
+    u8 page[PAGE_SIZE];         /* the page being rebuilt */
+    u8 piece[PAGE_SIZE + 3];    /* written bytes and the 3 before them, transformed */
+    u8 out[MYDISK_ZMAX];
+};
+
+static struct zs_pool *mydisk_pool;
+static DEFINE_PER_CPU(struct mydisk_zstream *, mydisk_zstream);
+
+/* a bucket per ~4 MiB of a 64 MiB disk, chains grow on bigger ones */
+#define MYDISK_DEDUP_BITS 12
+
+struct mydisk_dnode
+{
+    struct hlist_node node;
+    unsigned long handle;
+    u32 hash;
+    u16 len;
+    unsigned int refs;  /* tree entries pointing to the object */
+};
+
+static DEFINE_HASHTABLE(mydisk_dedup, MYDISK_DEDUP_BITS);
+static DEFINE_SPINLOCK(mydisk_dedup_lock);
+
+static void mydisk_zexit(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        vfree(per_cpu(mydisk_zstream, cpu));
+        per_cpu(mydisk_zstream, cpu) = NULL;
+    }
+    if (mydisk_pool)
+        zs_destroy_pool(mydisk_pool);
+    mydisk_pool = NULL;
+}
+
+static int mydisk_zinit(void)
+{
+    int cpu;
+
+    if (!compress)
+        return 0;
+    mydisk_pool = zs_create_pool("mydisk");
+    if (!mydisk_pool)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+    {
+        struct mydisk_zstream *zs = vmalloc_node(sizeof(*zs), cpu_to_node(cpu));
+
+        if (!zs)
+        {
+            mydisk_zexit();
+            return -ENOMEM;
+        }
+        per_cpu(mydisk_zstream, cpu) = zs;
+    }
+    return 0;
+}
+
+static u64 mydisk_zpool_pages(void)
+{
+    return mydisk_pool ? zs_get_total_pages(mydisk_pool) : 0;
+}
+
+/* Decompress n bytes at off of the page, under the stripe lock */
+static void mydisk_zread(void *entry, u8 *dst, unsigned int off, unsigned int n)
+{
+    unsigned long handle = mydisk_zhandle(entry);
+    struct mydisk_zstream *zs = this_cpu_read(mydisk_zstream);
+    u8 *to = n == PAGE_SIZE ? dst : zs->page;
+    u8 *src;
+    int ret;
+
+    src = zs_map_object(mydisk_pool, handle, ZS_MM_RO);
+    ret = LZ4_decompress_safe((const char *)src + MYDISK_ZHDR, (char *)to,
+                              ((struct mydisk_zhdr *)src)->len, PAGE_SIZE);
+    zs_unmap_object(mydisk_pool, handle);
+    WARN_ON_ONCE(ret != PAGE_SIZE);
+    if (to != dst)
+        memcpy(dst, zs->page + off, n);
+}
+
+/* A stored object with the LZ4 data in out, its reference taken, or 0 */
+static unsigned long mydisk_dedup_get(const u8 *out)
+{
+    const struct mydisk_zhdr *hdr = (const struct mydisk_zhdr *)out;
+    struct mydisk_dnode *dn;
+    unsigned long handle = 0;
+    u8 *src;
+
+    spin_lock(&mydisk_dedup_lock);
+    hash_for_each_possible(mydisk_dedup, dn, node, hdr->hash)
+    {
+        if (dn->hash != hdr->hash || dn->len != hdr->len)
+            continue;
+        src = zs_map_object(mydisk_pool, dn->handle, ZS_MM_RO);
+        if (!memcmp(src + MYDISK_ZHDR, out + MYDISK_ZHDR, hdr->len))
+            handle = dn->handle;
+        zs_unmap_object(mydisk_pool, dn->handle);
+        if (handle)
+        {
+            dn->refs++;
+            break;
+        }
+    }
+    spin_unlock(&mydisk_dedup_lock);
+    if (handle)
+    {
+        atomic64_inc(&device.nr_zpages);
+        atomic64_inc(&device.nr_dup);
+    }
+    return handle;
+}
+
+static void mydisk_dedup_add(struct mydisk_dnode *dn, unsigned long handle,
+                             const struct mydisk_zhdr *hdr)
+{
+    dn->handle = handle;
+    dn->hash = hdr->hash;
+    dn->len = hdr->len;
+    dn->refs = 1;
+    spin_lock(&mydisk_dedup_lock);
+    hash_add(mydisk_dedup, &dn->node, dn->hash);
+    spin_unlock(&mydisk_dedup_lock);
+}
+
+/* Drop a reference, true if it was the last one and the object is to be freed */
+static bool mydisk_dedup_put(unsigned long handle, u32 hash)
+{
+    struct mydisk_dnode *dn;
+    bool last = false;
+
+    spin_lock(&mydisk_dedup_lock);
+    hash_for_each_possible(mydisk_dedup, dn, node, hash)
+    {
+        if (dn->handle != handle)
+            continue;
+        last = !--dn->refs;
+        if (last)
+        {
+            hash_del(&dn->node);
+            kfree(dn);
+        }
+        break;
+    }
+    spin_unlock(&mydisk_dedup_lock);
+    return last;
+}
+
+/* The entry is out of the tree already */
+static void mydisk_zfree(void *entry)
+{
+    unsigned long handle = mydisk_zhandle(entry);
+    struct mydisk_zhdr hdr;
+    void *src;
+
+    src = zs_map_object(mydisk_pool, handle, ZS_MM_RO);
+    memcpy(&hdr, src, sizeof(hdr));
+    zs_unmap_object(mydisk_pool, handle);
+    atomic64_dec(&device.nr_zpages);
+    if (hdr.shared && !mydisk_dedup_put(handle, hdr.hash))
+    {
+        atomic64_dec(&device.nr_dup);
+        return;
+    }
+    zs_free(mydisk_pool, handle);
+    atomic64_sub(MYDISK_ZHDR + hdr.len, &device.compr_size);
+}
+
+/*
+ * Write n bytes at off of page idx, buffer + done being the first of them.
+ * The new page is built and compressed under the stripe lock, memory for it
+ * is first tried without sleeping. When that fails the lock is dropped, the
+ * memory allocated with GFP_NOIO and the page built again, as it may have
+ * changed meanwhile. The transform result goes back to buffer only once the
+ * page is stored, so a retry sees the same input.
+ */
+static int mydisk_zwrite_page(u8 *buffer, pgoff_t idx, unsigned int off, unsigned int n,
+                              unsigned int done, bool transform)
+{
+    struct mydisk_stripe *st = mydisk_stripe(idx);
+    unsigned int k = min(done, 3u);
+    struct mydisk_dnode *dn = NULL;
+    struct mydisk_zstream *zs;
+    struct mydisk_zhdr *hdr;
+    struct page *page = NULL;
+    unsigned long handle = 0, shared;
+    size_t size = 0, need;
+    void *old, *entry;
+    int clen = 0, fill, ret = -ENOSPC;
+    u8 *dst;
+
+    for (;;)
+    {
+        if (radix_tree_preload(GFP_NOIO))
+            break;
+        mydisk_stripe_lock(st);
+        zs = this_cpu_read(mydisk_zstream);
+        old = mydisk_lookup(idx);
+        if (n < PAGE_SIZE || transform)
+            mydisk_copy_out(old ? old : mydisk_lookup_base(idx), zs->page, 0, PAGE_SIZE);
+        if (transform)
+        {
+            memcpy(zs->piece, buffer + done - k, k + n);
+            mydisk_transform_swar(zs->piece, zs->page + off, k, k + n);
+            memcpy(zs->page + off, zs->piece + k, n);
+        }
+        else
+        {
+            memcpy(zs->page + off, buffer + done, n);
+        }
+
+        need = 0;
+        fill = mydisk_same_filled(zs->page);
+        if (fill < 0)
+        {
+            clen = LZ4_compress_default((const char *)zs->page, (char *)zs->out + MYDISK_ZHDR,
+                                        PAGE_SIZE, MYDISK_ZMAX - MYDISK_ZHDR, zs->wrkmem);
+            if (clen > 0)
+                need = MYDISK_ZHDR + clen;
+        }
+
+        if (fill >= 0)
+        {
+            /* a zero page becomes a hole */
+            entry = fill ? mydisk_fill_entry(fill) : mydisk_zero_entry(idx);
+            if (entry && entry != old)
+                atomic64_inc(&device.nr_same);
+        }
+        else if (need)
+        {
+            hdr = (struct mydisk_zhdr *)zs->out;
+            hdr->len = clen;
+            hdr->hash = dedup ? jhash(zs->out + MYDISK_ZHDR, clen, 0) : 0;
+            hdr->shared = 0;
+            shared = dedup ? mydisk_dedup_get(zs->out) : 0;
+            if (shared)
+            {
+                entry = mydisk_zentry(shared);
+            }
+            else
+            {
+                if (size < need)
+                {
+                    if (handle)
+                        zs_free(mydisk_pool, handle);
+                    size = need;
+                    handle = zs_malloc(mydisk_pool, size, __GFP_KSWAPD_RECLAIM | __GFP_NOWARN |
+                                       __GFP_HIGHMEM | __GFP_MOVABLE);
+                    if (!handle)
+                        goto slow;
+                }
+                /* without a node the object is just not shared */
+                if (dedup && !dn)
+                    dn = kmalloc(sizeof(*dn), GFP_NOWAIT | __GFP_NOWARN);
+                hdr->shared = !!dn;
+                dst = zs_map_object(mydisk_pool, handle, ZS_MM_WO);
+                memcpy(dst, zs->out, need);
+                zs_unmap_object(mydisk_pool, handle);
+                if (dn)
+                    mydisk_dedup_add(dn, handle, hdr);
+                dn = NULL;
+                entry = mydisk_zentry(handle);
+                handle = 0;
+                atomic64_add(need, &device.compr_size);
+                atomic64_inc(&device.nr_zpages);
+            }
+        }
+        else
+        {
+            if (!mydisk_is_page(old) && !page)
+            {
+                page = mydisk_alloc_page(idx, GFP_NOWAIT | __GFP_NOWARN | __GFP_HIGHMEM, 0);
+                if (!page)
+                    goto slow;
+            }
+            /* incompressible, a plain page is overwritten in place */
+            entry = mydisk_is_page(old) ? old : page;
+            if (entry == page)
+            {
+                page->index = idx;
+                page = NULL;
+                atomic64_inc(&device.nr_pages);
+            }
+            dst = kmap_atomic(entry);
+            memcpy(dst, zs->page, PAGE_SIZE);
+            kunmap_atomic(dst);
+        }
+        if (entry != old)
+        {
+            spin_lock(&device.lock);
+            if (old)
+                radix_tree_delete(&device.pages, idx);
+            if (entry)
+                radix_tree_insert(&device.pages, idx, entry);
+            spin_unlock(&device.lock);
+        }
+        if (transform)
+            memcpy(buffer + done, zs->piece + k, n);
+        mydisk_stripe_unlock(st);
+        radix_tree_preload_end();
+        /* rewriting a page with its own content took one more reference */
+        if (entry != old || mydisk_is_zentry(old))
+            mydisk_free_entry(old);
+        ret = 0;
+        break;
+slow:
+        mydisk_stripe_unlock(st);
+        radix_tree_preload_end();
+        if (need)
+        {
+            handle = zs_malloc(mydisk_pool, size, GFP_NOIO | __GFP_HIGHMEM | __GFP_MOVABLE);
+            if (!handle)
+                break;
+        }
+        else
+        {
+            page = mydisk_alloc_page(idx, GFP_NOIO | __GFP_HIGHMEM, 0);
+            if (!page)
+                break;
+        }
+    }
+    if (handle)
+        zs_free(mydisk_pool, handle);
+    if (page)
+        __free_page(page);
+    kfree(dn);
+    return ret;
+}
+
+#else
+
+static void mydisk_zexit(void)
+{
+}
+
+static int mydisk_zinit(void)
+{
+    if (!compress)
+        return 0;
+    printk(KERN_ERR "mydisk: compress needs CONFIG_ZSMALLOC and CONFIG_LZ4_COMPRESS\n");
+    return -EOPNOTSUPP;
+}
+
+static u64 mydisk_zpool_pages(void)
+{
+    return 0;
+}
+
+static void mydisk_zread(void *entry, u8 *dst, unsigned int off, unsigned int n)
+{
+}
+
+static void mydisk_zfree(void *entry)
+{
+}
+
+static int mydisk_zwrite_page(u8 *buffer, pgoff_t idx, unsigned int off, unsigned int n,
+                              unsigned int done, bool transform)
+{
+    return -EOPNOTSUPP;
+}
+#endif
+
+/* Write a segment to the compressed store, it may sleep */
+static int mydisk_zwrite(u8 *buffer, sector_t sector, unsigned int len, bool transform)
+{
+    unsigned int off = (sector & (PAGE_SECTORS - 1)) << 9;
+    unsigned int done = 0;
+    int ret;
+
+    while (done < len)
+    {
+        unsigned int n = min_t(unsigned int, len - done, PAGE_SIZE - off);
+
+        ret = mydisk_zwrite_page(buffer, sector >> PAGE_SECTORS_SHIFT, off, n, done, transform);
+        if (ret)
+            return ret;
+        done += n;
+        sector += n >> 9;
+        off = 0;
+    }
+    return 0;
+}
+
+/* n bytes at off of the page behind entry, the lock of its stripe held for a pool handle */
+static void mydisk_copy_out(void *entry, u8 *dst, unsigned int off, unsigned int n)
+{
+    u8 *device_data;
+
+    if (!entry)
+    {
+        memset(dst, 0, n);
+    }
+    else if (mydisk_is_fill(entry))
+    {
+        memset(dst, mydisk_fill_byte(entry), n);
+    }
+    else if (mydisk_is_zentry(entry))
+    {
+        mydisk_zread(entry, dst, off, n);
+    }
+    else
+    {
+        device_data = kmap_atomic(entry);
+        memcpy(dst, device_data + off, n);
+        kunmap_atomic(device_data);
+    }
+}
+
+/* The entry is out of the tree already */
+static void mydisk_free_entry(void *entry)
+{
+    if (!entry)
+        return;
+    if (mydisk_is_fill(entry))
+    {
+        atomic64_dec(&device.nr_same);
+        return;
+    }
+    if (mydisk_is_zentry(entry))
+    {
+        mydisk_zfree(entry);
+        return;
+    }
+    atomic64_dec(&device.nr_pages);
+    if (PageCompound((struct page *)entry))
+        mydisk_put_huge(compound_head((struct page *)entry));
+    else
+        call_rcu(&((struct page *)entry)->rcu_head, mydisk_free_page_rcu);
+}
+
+#define FREE_BATCH 16
+
+/* Up to FREE_BATCH indexes of entries of root in [first, last) */
+static int mydisk_gather(struct radix_tree_root *root, pgoff_t first, pgoff_t last,
+                         pgoff_t *idx)
+{
+    struct radix_tree_iter iter;
+    void __rcu **slot;
+    int nr = 0;
+
+    rcu_read_lock();
+    radix_tree_for_each_slot(slot, root, &iter, first)
+    {
+        if (radix_tree_deref_retry(radix_tree_deref_slot(slot)))
+        {
+            slot = radix_tree_iter_retry(&iter);
+            continue;
+        }
+        if (iter.index >= last)
+            break;
+        idx[nr++] = iter.index;
+        if (nr == FREE_BATCH)
+            break;
+    }
+    rcu_read_unlock();
+    return nr;
+}
+
+/*
+ * Free the pages of root with index in [first, last). Only pages that exist
+ * are visited, so discarding a huge mostly empty range is cheap. As with brd,
+ * I/O racing with a discard of the same range is the submitter's problem.
+ */
+static void mydisk_free_range(struct radix_tree_root *root, pgoff_t first, pgoff_t last)
+{
+    pgoff_t idx[FREE_BATCH];
+    int nr, i;
+
+    while (first < last)
+    {
+        nr = mydisk_gather(root, first, last, idx);
+        for (i = 0; i < nr; i++)
+        {
+            struct mydisk_stripe *st = mydisk_stripe(idx[i]);
+            void *gone;
+
+            mydisk_stripe_lock(st);
+            spin_lock(&device.lock);
+            gone = radix_tree_delete(root, idx[i]);
+            spin_unlock(&device.lock);
+            mydisk_stripe_unlock(st);
+            mydisk_free_entry(gone);
+        }
+        if (nr < FREE_BATCH)
+            break;
+        first = idx[nr - 1] + 1;
+        cond_resched();
+    }
+}
+
+/*
+ * After a discard the snapshot pages in [first, last) must not show through,
+ * each gets a zero fill entry over it.
+ */
+static int mydisk_hide_base(pgoff_t first, pgoff_t last)
+{
+    pgoff_t idx[FREE_BATCH];
+    int nr, i;
+
+    while (first < last)
+    {
+        nr = mydisk_gather(&device.base, first, last, idx);
+        for (i = 0; i < nr; i++)
+        {
+            struct mydisk_stripe *st = mydisk_stripe(idx[i]);
+
+            if (radix_tree_preload(GFP_NOIO))
+                return -ENOSPC;
+            mydisk_stripe_lock(st);
+            /* unless a write got there in the meantime */
+            if (!mydisk_lookup(idx[i]))
+            {
+                spin_lock(&device.lock);
+                radix_tree_insert(&device.pages, idx[i], mydisk_fill_entry(0));
+                spin_unlock(&device.lock);
+                atomic64_inc(&device.nr_same);
+            }
+            mydisk_stripe_unlock(st);
+            radix_tree_preload_end();
+        }
+        if (nr < FREE_BATCH)
+            break;
+        first = idx[nr - 1] + 1;
+        cond_resched();
+    }
+    return 0;
+}
+
+static void mydisk_free_pages(void)
+{
+    mydisk_free_range(&device.pages, 0, ULONG_MAX);
+    mydisk_free_range(&device.base, 0, ULONG_MAX);
+    rcu_barrier();
+}
+
+/* Zero len bytes at off in the page of sector, a hole is zero already */
+static int mydisk_zero_page(sector_t sector, unsigned int off, unsigned int len)
+{
+    struct mydisk_stripe *st = mydisk_stripe(sector >> PAGE_SECTORS_SHIFT);
+    struct page *page;
+    u8 *device_data;
+
+    if (compress)
+    {
+        if (!mydisk_lookup_view(sector >> PAGE_SECTORS_SHIFT, false))
+            return 0;
+        sector = round_down(sector, PAGE_SECTORS) + (off >> 9);
+        return mydisk_zwrite(page_address(ZERO_PAGE(0)), sector, len, false);
+    }
+    /* a same-filled or a snapshot page needs its bytes back first */
+    if (mydisk_lookup_view(sector >> PAGE_SECTORS_SHIFT, false) && !mydisk_insert_page(sector))
+        return -ENOSPC;
+    mydisk_stripe_lock(st);
+    page = mydisk_lookup_page(sector);
+    if (page)
+    {
+        device_data = kmap_atomic(page);
+        memset(device_data + off, 0, len);
+        kunmap_atomic(device_data);
+    }
+    mydisk_stripe_unlock(st);
+    return 0;
+}
+
+/*
+ * DISCARD and WRITE_ZEROES: whole pages go back to the system, the partly
+ * covered pages at the edges are zeroed. Either way the range reads as zeros.
+ * Zeroing part of a compressed page needs memory, so this may fail.
+ */
+static int mydisk_discard(sector_t sector, sector_t nr_sects)
+{
+    sector_t end = sector + nr_sects;
+    pgoff_t first = (sector + PAGE_SECTORS - 1) >> PAGE_SECTORS_SHIFT;
+    pgoff_t last = end >> PAGE_SECTORS_SHIFT;
+    int ret = 0;
+
+    if (first > last)
+    {
+        /* inside a single page */
+        ret = mydisk_zero_page(sector, (sector & (PAGE_SECTORS - 1)) << 9, nr_sects << 9);
+        mydisk_mark_dirty(sector, nr_sects);
+        return ret;
+    }
+    if (sector & (PAGE_SECTORS - 1))
+        ret = mydisk_zero_page(sector, (sector & (PAGE_SECTORS - 1)) << 9,
+                               (((sector_t)first << PAGE_SECTORS_SHIFT) - sector) << 9);
+    mydisk_free_range(&device.pages, first, last);
+    if (!ret)
+        ret = mydisk_hide_base(first, last);
+    if (!ret && (end & (PAGE_SECTORS - 1)))
+        ret = mydisk_zero_page(end, 0, (end & (PAGE_SECTORS - 1)) << 9);
+    mydisk_mark_dirty(sector, nr_sects);
+    return ret;
+}
+
+/* Plain copy into the store, used for the partition tables */
+static int mydisk_store(const u8 *src, sector_t sector, unsigned int len)
+{
+    unsigned int off = (sector & (PAGE_SECTORS - 1)) << 9;
+    unsigned int done = 0;
+    int ret;
+
+    /* src is only written to by the transform */
+    if (compress)
+        return mydisk_zwrite((u8 *)src, sector, len, false);
+    ret = mydisk_setup_pages(sector, len);
+    if (ret)
+        return ret;
+    while (done < len)
+    {
+        unsigned int n = min_t(unsigned int, len - done, PAGE_SIZE - off);
+        u8 *device_data = kmap_atomic(mydisk_lookup_page(sector));
+
+        memcpy(device_data + off, src + done, n);
+        kunmap_atomic(device_data);
+        done += n;
+        sector += n >> 9;
+        off = 0;
+    }
+    return 0;
+}
+
+static void mydisk_read(u8 *buffer, sector_t sector, unsigned int len, bool snap);
+
+/****************************************************************************************
+ *                           BACKING FILE
+ * With backing_file set the disk survives rmmod. Every write and discard sets the bit of
+ * its pages in mydisk_dirty, and a delayed work writes the dirty runs out in batches of
+ * up to WB_BATCH pages, punching holes for runs that read as zeros. A flush request
+ * waits for a full writeback and fsync, so the queue advertises a write cache. On load a
+ * file of the size of the disk is streamed back in, and an empty one is sized and
+ * filled by the first writeback.
+*****************************************************************************************/
+
+#define WB_BATCH 256    /* pages, 1 MiB per write */
+
+static struct file *mydisk_file;
+static unsigned long *mydisk_dirty;
+static unsigned long mydisk_file_pages;
+static u8 *mydisk_wb_buf;
+static DEFINE_MUTEX(mydisk_wb_lock);
+
+static void mydisk_wb_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(mydisk_wb, mydisk_wb_work);
+
+static void mydisk_mark_dirty(sector_t sector, sector_t nr_sects)
+{
+    pgoff_t idx, last;
+
+    if (!mydisk_dirty || !nr_sects)
+        return;
+    last = (sector + nr_sects - 1) >> PAGE_SECTORS_SHIFT;
+    for (idx = sector >> PAGE_SECTORS_SHIFT; idx <= last; idx++)
+        set_bit(idx, mydisk_dirty);
+}
+
+/*
+ * A bit is cleared before its page is read, so a write racing with the copy
+ * sets it again and the page goes out once more next time.
+ */
+static int mydisk_writeback(void)
+{
+    unsigned long idx = 0, end, i;
+    size_t len;
+    loff_t pos;
+    int ret = 0;
+
+    mutex_lock(&mydisk_wb_lock);
+    while ((idx = find_next_bit(mydisk_dirty, mydisk_file_pages, idx)) < mydisk_file_pages)
+    {
+        end = find_next_zero_bit(mydisk_dirty, min(mydisk_file_pages, idx + WB_BATCH), idx);
+        for (i = idx; i < end; i++)
+            clear_bit(i, mydisk_dirty);
+        len = (end - idx) << PAGE_SHIFT;
+        mydisk_read(mydisk_wb_buf, (sector_t)idx << PAGE_SECTORS_SHIFT, len, false);
+        pos = (loff_t)idx << PAGE_SHIFT;
+        if (memchr_inv(mydisk_wb_buf, 0, len) ||
+            vfs_fallocate(mydisk_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len))
+        {
+            if (kernel_write(mydisk_file, mydisk_wb_buf, len, &pos) != len)
+            {
+                for (i = idx; i < end; i++)
+                    set_bit(i, mydisk_dirty);
+                ret = -EIO;
+                break;
+            }
+        }
+        idx = end;
+        cond_resched();
+    }
+    mutex_unlock(&mydisk_wb_lock);
+    return ret;
+}
+
+static void mydisk_wb_work(struct work_struct *work)
+{
+    if (mydisk_writeback())
+        printk(KERN_ERR "mydisk: writeback to %s failed\n", backing_file);
+    queue_delayed_work(system_long_wq, &mydisk_wb, msecs_to_jiffies(READ_ONCE(writeback_ms)));
+}
+
+/* A flush request: everything written so far must be on the file */
+static int mydisk_flush(void)
+{
+    int ret;
+
+    if (!mydisk_file)
+        return 0;
+    ret = mydisk_writeback();
+    if (!ret)
+        ret = vfs_fsync(mydisk_file, 0);
+    return ret;
+}
+
+/* Stream the image in, pages of zeros stay holes */
+static int mydisk_file_load(void)
+{
+    unsigned long idx, i;
+    size_t len;
+    loff_t pos;
+    int ret;
+
+    for (idx = 0; idx < mydisk_file_pages; idx += WB_BATCH)
+    {
+        len = min(mydisk_file_pages - idx, (unsigned long)WB_BATCH) << PAGE_SHIFT;
+        pos = (loff_t)idx << PAGE_SHIFT;
+        if (kernel_read(mydisk_file, mydisk_wb_buf, len, &pos) != len)
+            return -EIO;
+        for (i = 0; i < len >> PAGE_SHIFT; i++)
+        {
+            u8 *data = mydisk_wb_buf + (i << PAGE_SHIFT);
+
+            if (!memchr_inv(data, 0, PAGE_SIZE))
+                continue;
+            ret = mydisk_store(data, (sector_t)(idx + i) << PAGE_SECTORS_SHIFT, PAGE_SIZE);
+            if (ret)
+                return ret;
+        }
+        cond_resched();
+    }
+    return 0;
+}
+
+static void mydisk_file_close(void)
+{
+    if (!mydisk_file)
+        return;
+    cancel_delayed_work_sync(&mydisk_wb);
+    if (mydisk_dirty && mydisk_wb_buf && mydisk_flush())
+        printk(KERN_ERR "mydisk: %s is not up to date\n", backing_file);
+    filp_close(mydisk_file, NULL);
+    mydisk_file = NULL;
+    vfree(mydisk_dirty);
+    mydisk_dirty = NULL;
+    vfree(mydisk_wb_buf);
+    mydisk_wb_buf = NULL;
+}
+
+/*
+ * Open the backing file. Returns 1 when it held an image that is now loaded,
+ * 0 when the disk starts empty.
+ */
+static int mydisk_file_open(sector_t capacity)
+{
+    loff_t size = (loff_t)capacity << 9;
+    loff_t have;
+    int ret;
+
+    if (!backing_file)
+        return 0;
+    mydisk_file = filp_open(backing_file, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(mydisk_file))
+    {
+        ret = PTR_ERR(mydisk_file);
+        mydisk_file = NULL;
+        return ret;
+    }
+    have = i_size_read(file_inode(mydisk_file));
+    if (have && have != size)
+    {
+        printk(KERN_ERR "mydisk: %s holds %lld bytes, the disk is %lld\n",
+               backing_file, have, size);
+        filp_close(mydisk_file, NULL);
+        mydisk_file = NULL;
+        return -EINVAL;
+    }
+
+    mydisk_file_pages = capacity >> PAGE_SECTORS_SHIFT;
+    mydisk_dirty = vzalloc(BITS_TO_LONGS(mydisk_file_pages) * sizeof(long));
+    mydisk_wb_buf = vmalloc(WB_BATCH << PAGE_SHIFT);
+    if (!mydisk_dirty || !mydisk_wb_buf)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (have)
+    {
+        ret = mydisk_file_load();
+        if (ret)
+            goto out;
+        printk(KERN_INFO "mydisk: loaded from %s\n", backing_file);
+        return 1;
+    }
+    ret = vfs_truncate(&mydisk_file->f_path, size);
+    if (ret)
+        goto out;
+    return 0;
+out:
+    /* nothing is dirty yet, closing writes nothing back */
+    mydisk_file_close();
+    return ret;
+}
+
+int mydisk_init(void)
+{
+    sector_t capacity = MB2SEC(disk_size_mb);
+    int i, ret;
+
+    spin_lock_init(&device.lock);
+    INIT_RADIX_TREE(&device.pages, GFP_ATOMIC);
+    INIT_RADIX_TREE(&device.base, GFP_ATOMIC);
+    for (i = 0; i < MYDISK_STRIPES; i++)
+    {
+        spin_lock_init(&device.stripes[i].lock);
+        seqcount_init(&device.stripes[i].seq);
+    }
+    if (!disk_size_mb)
+        return -EINVAL;
+    if (dedup && !compress)
+    {
+        printk(KERN_ERR "mydisk: dedup works on the compressed store, it needs compress\n");
+        return -EINVAL;
+    }
+    if (huge_pages && compress)
+    {
+        printk(KERN_ERR "mydisk: huge_pages backs plain pages, it cannot be used with compress\n");
+        return -EINVAL;
+    }
+    if (numa_node != NUMA_NO_NODE &&
+        (numa_interleave || numa_node < 0 || numa_node >= MAX_NUMNODES || !node_online(numa_node)))
+    {
+        printk(KERN_ERR "mydisk: numa_node %d is not an online node to bind to\n", numa_node);
+        return -EINVAL;
+    }
+    ret = mydisk_plan(capacity);
+    if (ret)
+        return ret;
+    ret = mydisk_zinit();
+    if (ret)
+        return ret;
+    ret = mydisk_file_open(capacity);
+    if (ret < 0)
+    {
+        mydisk_free_pages();
+        mydisk_zexit();
+        return ret;
+    }
+    /* Setup its partition table, unless it came with the image */
+    if (!ret)
+    {
+        ret = copy_mbr_n_br(capacity);
+        if (ret)
+        {
+            mydisk_file_close();
+            mydisk_free_pages();
+            mydisk_zexit();
+            return ret;
+        }
+        mydisk_mark_dirty(0, capacity);
+    }
+
+    device.size = capacity;
+    if (mydisk_file)
+        queue_delayed_work(system_long_wq, &mydisk_wb, msecs_to_jiffies(writeback_ms));
+    return 0;
+}
+
+/*
+ * Read one segment of the disk, or of its snapshot. Holes read back as
+ * zeros.
+ */
+static void mydisk_read(u8 *buffer, sector_t sector, unsigned int len, bool snap)
+{
+    unsigned int off = (sector & (PAGE_SECTORS - 1)) << 9;
+    unsigned int done = 0;
+
+    while (done < len)
+    {
+        unsigned int n = min_t(unsigned int, len - done, PAGE_SIZE - off);
+        pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+        struct mydisk_stripe *st = mydisk_stripe(idx);
+        unsigned int seq;
+        void *entry;
+
+        rcu_read_lock();
+        do
+        {
+            seq = read_seqcount_begin(&st->seq);
+            entry = mydisk_lookup_view(idx, snap);
+            if (mydisk_is_zentry(entry))
+                break;
+            mydisk_copy_out(entry, buffer + done, off, n);
+        } while (read_seqcount_retry(&st->seq, seq));
+        rcu_read_unlock();
+        if (mydisk_is_zentry(entry))
+        {
+            /* pool objects are freed at once, decompress under the lock */
+            spin_lock(&st->lock);
+            mydisk_copy_out(mydisk_lookup_view(idx, snap), buffer + done, off, n);
+            spin_unlock(&st->lock);
+        }
+        done += n;
+        sector += n >> 9;
+        off = 0;
+    }
+}
+
+/*
+ * Copy one segment between the request and the disk. Writes need their
+ * pages set up by mydisk_setup_pages().
+ */
+static void mydisk_transfer(u8 *buffer, sector_t sector, unsigned int len, int dir)
+{
+    unsigned int off = (sector & (PAGE_SECTORS - 1)) << 9;
+    unsigned int done = 0;
+
+    if (dir == READ)
+    {
+        mydisk_read(buffer, sector, len, false);
+        return;
+    }
+    while (done < len)
+    {
+        unsigned int n = min_t(unsigned int, len - done, PAGE_SIZE - off);
+        struct mydisk_stripe *st = mydisk_stripe(sector >> PAGE_SECTORS_SHIFT);
+        struct page *page;
+        u8 *device_data;
+
+        mydisk_stripe_lock(st);
+        /* gone only if a discard or an overlapping write overtook this one */
+        page = mydisk_lookup_page(sector);
+        if (page)
+        {
+            device_data = kmap_atomic(page);
+            if (READ_ONCE(write_transform))
+                mydisk_transform_swar(buffer, device_data + off, done, done + n);
+            memcpy(device_data + off, buffer + done, n);
+            kunmap_atomic(device_data);
+        }
+        mydisk_stripe_unlock(st);
+        done += n;
+        sector += n >> 9;
+        off = 0;
+    }
+}
+
+/*
+ * Plain page idx, if same-filled, is replaced by its byte or by a hole (a
+ * zero fill over a snapshot page)
+ */
+static void mydisk_compact_page(pgoff_t idx)
+{
+    struct mydisk_stripe *st = mydisk_stripe(idx);
+    void *entry, *same = NULL;
+    int fill = -1;
+    u8 *data;
+
+    if (radix_tree_preload(GFP_NOIO))
+        return;
+    mydisk_stripe_lock(st);
+    entry = mydisk_lookup(idx);
+    if (mydisk_is_page(entry))
+    {
+        data = kmap_atomic(entry);
+        fill = mydisk_same_filled(data);
+        kunmap_atomic(data);
+    }
+    if (fill >= 0)
+    {
+        same = fill ? mydisk_fill_entry(fill) : mydisk_zero_entry(idx);
+        spin_lock(&device.lock);
+        radix_tree_delete(&device.pages, idx);
+        if (same)
+            radix_tree_insert(&device.pages, idx, same);
+        spin_unlock(&device.lock);
+        if (same)
+            atomic64_inc(&device.nr_same);
+    }
+    mydisk_stripe_unlock(st);
+    radix_tree_preload_end();
+    if (fill >= 0)
+        mydisk_free_entry(entry);
+}
+
+/*
+ * Look at the pages a write covered whole, most are not same-filled and
+ * that shows in the first word. Not with huge_pages, where a freed subpage
+ * gives no memory back.
+ */
+static void mydisk_compact(sector_t sector, unsigned int len)
+{
+    unsigned int off = (sector & (PAGE_SECTORS - 1)) << 9;
+    unsigned int done = 0;
+
+    if (huge_pages)
+        return;
+    while (done < len)
+    {
+        unsigned int n = min_t(unsigned int, len - done, PAGE_SIZE - off);
+
+        if (n == PAGE_SIZE)
+            mydisk_compact_page(sector >> PAGE_SECTORS_SHIFT);
+        done += n;
+        sector += n >> 9;
+        off = 0;
+    }
+}
+
+/* One bvec of a request or a bio, pages for a write are set up first */
+static int mydisk_do_bvec(struct bio_vec *bv, sector_t sector, int dir)
+{
+    u8 *buffer;
+    int ret;
+
+    if (dir == WRITE && compress)
+    {
+        /* compressed writes allocate as they go and may sleep */
+        buffer = kmap(bv->bv_page);
+        ret = mydisk_zwrite(buffer + bv->bv_offset, sector, bv->bv_len,
+                            READ_ONCE(write_transform));
+        kunmap(bv->bv_page);
+        if (!ret)
+            mydisk_mark_dirty(sector, bv->bv_len >> 9);
+        return ret;
+    }
+
+    if (dir == WRITE && mydisk_setup_pages(sector, bv->bv_len))
+        return -ENOSPC;
+    buffer = kmap_atomic(bv->bv_page);
+    mydisk_transfer(buffer + bv->bv_offset, sector, bv->bv_len, dir);
+    kunmap_atomic(buffer);
+    if (dir == WRITE)
+    {
+        mydisk_compact(sector, bv->bv_len);
+        mydisk_mark_dirty(sector, bv->bv_len >> 9);
+    }
+    return 0;
+}
+
+/****************************************************************************************
+ *                           OFFLOADED WRITES
+ * The transform restarts at every segment, so segments are independent. A large write
+ * is cut into chunks of CHUNK_SEGS segments which are handed round robin to the CPUs of
+ * a per-CPU workqueue; the last chunk to finish completes the request or the bio.
+*****************************************************************************************/
+
+#define CHUNK_SEGS 16
+
+static struct workqueue_struct *mydisk_wq;
+
+/* In the request PDU in blk-mq mode, allocated per bio in bio mode */
+struct mydisk_io
+{
+    atomic_t pending;   /* chunks in flight, plus one held by the submitter */
+    blk_status_t status;
+    struct request *req;
+    struct bio *bio;
+};
+
+struct mydisk_chunk
+{
+    struct work_struct work;
+    struct mydisk_io *io;
+    sector_t sector;
+    int nr;
+    struct bio_vec bv[CHUNK_SEGS];
+};
+
+static bool mydisk_offload_wanted(unsigned int bytes)
+{
+    unsigned int kb = READ_ONCE(offload_kb);
+
+    return kb && bytes >= kb * 1024;
+}
+
+static void mydisk_io_init(struct mydisk_io *io, struct request *req, struct bio *bio)
+{
+    atomic_set(&io->pending, 1);
+    io->status = BLK_STS_OK;
+    io->req = req;
+    io->bio = bio;
+}
+
+static void mydisk_io_put(struct mydisk_io *io)
+{
+    if (!atomic_dec_and_test(&io->pending))
+        return;
+    if (io->req)
+    {
+        blk_mq_end_request(io->req, io->status);
+    }
+    else
+    {
+        io->bio->bi_status = io->status;
+        bio_endio(io->bio);
+        kfree(io);
+    }
+}
+
+static void mydisk_chunk_work(struct work_struct *work)
+{
+    struct mydisk_chunk *ch = container_of(work, struct mydisk_chunk, work);
+    sector_t sector = ch->sector;
+    int i;
+
+    for (i = 0; i < ch->nr; i++)
+    {
+        if (mydisk_do_bvec(&ch->bv[i], sector, WRITE))
+            WRITE_ONCE(ch->io->status, BLK_STS_NOSPC);
+        sector += ch->bv[i].bv_len >> 9;
+    }
+    mydisk_io_put(ch->io);
+    kfree(ch);
+}
+
+static void mydisk_queue_chunk(struct mydisk_chunk *ch, int *cpu)
+{
+    *cpu = cpumask_next(*cpu, cpu_online_mask);
+    if (*cpu >= nr_cpu_ids)
+        *cpu = cpumask_first(cpu_online_mask);
+    atomic_inc(&ch->io->pending);
+    INIT_WORK(&ch->work, mydisk_chunk_work);
+    queue_work_on(*cpu, mydisk_wq, &ch->work);
+}
+
+/*
+ * Add a segment to the chunk being filled and queue the chunk once it is
+ * full. Fails if no chunk could be allocated, the caller then does the
+ * segment itself.
+ */
+static int mydisk_chunk_add(struct mydisk_io *io, struct mydisk_chunk **chp,
+                            struct bio_vec *bv, sector_t sector, int *cpu)
+{
+    struct mydisk_chunk *ch = *chp;
+
+    if (!ch)
+    {
+        ch = kmalloc(sizeof(*ch), GFP_NOIO);
+        if (!ch)
+            return -ENOMEM;
+        ch->io = io;
+        ch->sector = sector;
+        ch->nr = 0;
+        *chp = ch;
+    }
+    ch->bv[ch->nr++] = *bv;
+    if (ch->nr == CHUNK_SEGS)
+    {
+        mydisk_queue_chunk(ch, cpu);
+        *chp = NULL;
+    }
+    return 0;
+}
+
+static void mydisk_offload_rq(struct request *req)
+{
+    struct mydisk_io *io = blk_mq_rq_to_pdu(req);
+    struct mydisk_chunk *ch = NULL;
+    sector_t sector = blk_rq_pos(req);
+    int cpu = raw_smp_processor_id();
+    struct req_iterator iter;
+    struct bio_vec bv;
+
+    mydisk_io_init(io, req, NULL);
+    rq_for_each_segment(bv, req, iter)
+    {
+        if (mydisk_chunk_add(io, &ch, &bv, sector, &cpu) && mydisk_do_bvec(&bv, sector, WRITE))
+            io->status = BLK_STS_NOSPC;
+        sector += bv.bv_len >> 9;
+    }
+    if (ch)
+        mydisk_queue_chunk(ch, &cpu);
+    mydisk_io_put(io);
+}
+
+static void mydisk_offload_bio(struct mydisk_io *io, struct bio *bio)
+{
+    struct mydisk_chunk *ch = NULL;
+    sector_t sector = bio->bi_iter.bi_sector;
+    int cpu = raw_smp_processor_id();
+    struct bvec_iter iter;
+    struct bio_vec bv;
+
+    mydisk_io_init(io, NULL, bio);
+    bio_for_each_segment(bv, bio, iter)
+    {
+        if (mydisk_chunk_add(io, &ch, &bv, sector, &cpu) && mydisk_do_bvec(&bv, sector, WRITE))
+            io->status = BLK_STS_NOSPC;
+        sector += bv.bv_len >> 9;
+    }
+    if (ch)
+        mydisk_queue_chunk(ch, &cpu);
+    mydisk_io_put(io);
+}
+
+static int rb_transfer(struct request *req)
+{
+    int dir = rq_data_dir(req);
+    int ret = 0;
+    /*starting sector
+     *where to do operation*/
+    sector_t start_sector = blk_rq_pos(req);
+    unsigned int sector_cnt = blk_rq_sectors(req); /* no of sector on which opn to be done*/
+    struct bio_vec bv;
+    struct req_iterator iter;
+    sector_t sector_offset;
+    unsigned int sectors;
+    sector_offset = 0;
+    rq_for_each_segment(bv, req, iter)
+    {
+        if (bv.bv_len % (SECTOR_SIZE) != 0)
+        {
+            printk(KERN_ERR"bio size is not a multiple ofsector size\n");
+            ret = -EIO;
+        }
+        sectors = bv.bv_len / SECTOR_SIZE;
+        // printk(KERN_DEBUG "my disk: Start Sector: %llu, Sector Offset: %llu;
+        // Length: %u sectors\n",
+        // (unsigned long long)(start_sector), (unsigned long long) 
+        // (sector_offset), sectors);
+
+        if (mydisk_do_bvec(&bv, start_sector + sector_offset, dir))
+            return -ENOSPC;
+        sector_offset += sectors;
+    }
+    
+    if (sector_offset != sector_cnt)
+    {
+        printk(KERN_ERR "mydisk: bio info doesn't match with the request info");
+        ret = -EIO;
+    }
+    return ret;
+}
+
+/****************************************************************************************
+ *                           POLLED COMPLETIONS
+ * With io_poll set a request is still served in queue_rq(), but instead of being ended
+ * there it is posted to the completion list of its hardware queue, as a controller would
+ * post a CQ entry. A submitter that polls (O_DIRECT preadv2() with RWF_HIPRI) spins in
+ * blk_poll(), which reaps the list through mydisk_poll() without ever sleeping. For all
+ * other submitters an hrtimer plays the interrupt and reaps the list poll_irq_us after
+ * it stopped being empty.
+*****************************************************************************************/
+
+struct mydisk_cq
+{
+    spinlock_t lock;
+    struct list_head done;
+    struct hrtimer irq;
+};
+
+static int mydisk_cq_reap(struct mydisk_cq *cq)
+{
+    struct request *req, *next;
+    unsigned long flags;
+    LIST_HEAD(done);
+    int n = 0;
+
+    spin_lock_irqsave(&cq->lock, flags);
+    list_splice_init(&cq->done, &done);
+    spin_unlock_irqrestore(&cq->lock, flags);
+    list_for_each_entry_safe(req, next, &done, queuelist)
+    {
+        list_del_init(&req->queuelist);
+        blk_mq_complete_request(req);
+        n++;
+    }
+    return n;
+}
+
+static enum hrtimer_restart mydisk_cq_irq(struct hrtimer *timer)
+{
+    mydisk_cq_reap(container_of(timer, struct mydisk_cq, irq));
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * The timer is armed by whoever finds the list empty, so an entry posted
+ * while the timer reaps is never left behind.
+ */
+static void mydisk_cq_post(struct mydisk_cq *cq, struct request *req)
+{
+    unsigned long flags;
+    bool first;
+
+    spin_lock_irqsave(&cq->lock, flags);
+    first = list_empty(&cq->done);
+    list_add_tail(&req->queuelist, &cq->done);
+    if (first)
+        hrtimer_start(&cq->irq, ns_to_ktime((u64)READ_ONCE(poll_irq_us) * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+    spin_unlock_irqrestore(&cq->lock, flags);
+}
+
+/* Any entry will do, the one blk_poll() waits for is among them */
+static int mydisk_poll(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+    return mydisk_cq_reap(hctx->driver_data);
+}
+
+static void mydisk_complete(struct request *req)
+{
+    struct mydisk_io *io = blk_mq_rq_to_pdu(req);
+
+    blk_mq_end_request(req, io->status);
+}
+
+static int mydisk_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int idx)
+{
+    struct mydisk_cq *cq = kzalloc_node(sizeof(*cq), GFP_KERNEL, hctx->numa_node);
+
+    if (!cq)
+        return -ENOMEM;
+    spin_lock_init(&cq->lock);
+    INIT_LIST_HEAD(&cq->done);
+    hrtimer_init(&cq->irq, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    cq->irq.function = mydisk_cq_irq;
+    hctx->driver_data = cq;
+    return 0;
+}
+
+/* The queue is drained by now, only a stray timer may be left */
+static void mydisk_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int idx)
+{
+    struct mydisk_cq *cq = hctx->driver_data;
+
+    hrtimer_cancel(&cq->irq);
+    kfree(cq);
+}
+
+/*
+ * Request handling function. Every hardware context runs it on its own CPU,
+ * there is no queue lock to fight over.
+ */
+static blk_status_t dev_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                 const struct blk_mq_queue_data *bd)
+{
+    struct request *req = bd->rq;
+    blk_status_t status = BLK_STS_OK;
+
+    blk_mq_start_request(req);
+    switch (req_op(req))
+    {
+    case REQ_OP_WRITE:
+        if (mydisk_offload_wanted(blk_rq_bytes(req)))
+        {
+            /* completed by the last chunk */
+            mydisk_offload_rq(req);
+            return BLK_STS_OK;
+        }
+        /* fall through */
+    case REQ_OP_READ:
+        status = errno_to_blk_status(rb_transfer(req)); // transfer the request for operation
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        status = errno_to_blk_status(mydisk_discard(blk_rq_pos(req), blk_rq_sectors(req)));
+        break;
+    case REQ_OP_FLUSH:
+        status = errno_to_blk_status(mydisk_flush());
+        break;
+    default:
+        status = BLK_STS_NOTSUPP;
+        break;
+    }
+    if (io_poll)
+    {
+        struct mydisk_io *io = blk_mq_rq_to_pdu(req);
+
+        /* ended by mydisk_complete() */
+        io->status = status;
+        mydisk_cq_post(hctx->driver_data, req);
+        return BLK_STS_OK;
+    }
+    blk_mq_end_request(req, status); // end the request
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops mydisk_mq_ops =
+{
+    .queue_rq = dev_queue_rq,
+};
+
+static const struct blk_mq_ops mydisk_poll_mq_ops =
+{
+    .queue_rq = dev_queue_rq,
+    .complete = mydisk_complete,
+    .init_hctx = mydisk_init_hctx,
+    .exit_hctx = mydisk_exit_hctx,
+    .poll = mydisk_poll,
+};
+
+/* Handle a bio that is within the disk and end it */
+static void mydisk_bio_rw(struct bio *bio)
+{
+    sector_t sector = bio->bi_iter.bi_sector;
+    int dir = op_is_write(bio_op(bio)) ? WRITE : READ;
+    struct bio_vec bv;
+    struct bvec_iter iter;
+    struct mydisk_io *io;
+
+    /* only with a backing file, the queue has no write cache otherwise */
+    if ((bio->bi_opf & REQ_PREFLUSH) && mydisk_flush())
+    {
+        bio->bi_status = BLK_STS_IOERR;
+        goto out;
+    }
+    switch (bio_op(bio))
+    {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        bio->bi_status = errno_to_blk_status(mydisk_discard(sector, bio_sectors(bio)));
+        goto out;
+    default:
+        bio->bi_status = BLK_STS_NOTSUPP;
+        goto out;
+    }
+
+    if (dir == WRITE && !(bio->bi_opf & REQ_FUA) &&
+        mydisk_offload_wanted(bio->bi_iter.bi_size))
+    {
+        io = kmalloc(sizeof(*io), GFP_NOIO);
+        if (io)
+        {
+            /* completed by the last chunk */
+            mydisk_offload_bio(io, bio);
+            return;
+        }
+    }
+
+    bio_for_each_segment(bv, bio, iter)
+    {
+        if (mydisk_do_bvec(&bv, sector, dir))
+        {
+            bio->bi_status = BLK_STS_NOSPC;
+            goto out;
+        }
+        sector += bv.bv_len >> 9;
+    }
+    if ((bio->bi_opf & REQ_FUA) && mydisk_flush())
+        bio->bi_status = BLK_STS_IOERR;
+out:
+    bio_endio(bio);
+}
+
+/*
+ * A flush writes to the backing file and waits for that I/O. Inside
+ * generic_make_request() the bios it submits would only be queued on
+ * current->bio_list and never run, so flushing bios go to a worker, in
+ * order, as loop does it.
+ */
+static struct bio_list mydisk_flush_bios = BIO_EMPTY_LIST;
+static DEFINE_SPINLOCK(mydisk_flush_lock);
+
+static void mydisk_flush_work_fn(struct work_struct *work)
+{
+    struct bio *bio;
+
+    for (;;)
+    {
+        spin_lock_irq(&mydisk_flush_lock);
+        bio = bio_list_pop(&mydisk_flush_bios);
+        spin_unlock_irq(&mydisk_flush_lock);
+        if (!bio)
+            break;
+        mydisk_bio_rw(bio);
+    }
+}
+
+static DECLARE_WORK(mydisk_flush_work, mydisk_flush_work_fn);
+
+/*
+ * Bio based mode: a RAM disk has nothing to gain from merging or an I/O
+ * scheduler, so bios are copied right in the submitter's context.
+ */
+static blk_qc_t mydisk_make_request(struct request_queue *q, struct bio *bio)
+{
+    if (bio_end_sector(bio) > device.size)
+    {
+        bio->bi_status = BLK_STS_IOERR;
+        bio_endio(bio);
+        return BLK_QC_T_NONE;
+    }
+    if (mydisk_file && (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)))
+    {
+        spin_lock_irq(&mydisk_flush_lock);
+        bio_list_add(&mydisk_flush_bios, bio);
+        spin_unlock_irq(&mydisk_flush_lock);
+        queue_work(mydisk_wq, &mydisk_flush_work);
+        return BLK_QC_T_NONE;
+    }
+    mydisk_bio_rw(bio);
+    return BLK_QC_T_NONE;
+}
+
+/*
+ * /sys/block/mydisk/mm_stat, in the spirit of zram: bytes of data stored,
+ * bytes they take compressed, memory used by the store in all, then the
+ * number of compressed, plain, same-filled and deduplicated pages.
+ */
+static ssize_t mm_stat_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    u64 nr_pages = atomic64_read(&device.nr_pages);
+    u64 nr_zpages = atomic64_read(&device.nr_zpages);
+    u64 nr_same = atomic64_read(&device.nr_same);
+
+    return scnprintf(buf, PAGE_SIZE, "%8llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
+                     (nr_pages + nr_zpages + nr_same) << PAGE_SHIFT,
+                     (u64)atomic64_read(&device.compr_size),
+                     (nr_pages + mydisk_zpool_pages()) << PAGE_SHIFT,
+                     nr_zpages, nr_pages, nr_same,
+                     (u64)atomic64_read(&device.nr_dup));
+}
+static DEVICE_ATTR_RO(mm_stat);
+
+/****************************************************************************************
+ *                           SNAPSHOT
+ * Writing 1 to /sys/block/mydisk/snapshot freezes the store as it is: with the queue
+ * frozen the page tree moves to device.base, which costs the same for any disk size,
+ * and the disk goes on with an empty overlay tree. Frozen pages are shared, the disk
+ * copies one up only when it writes to it, and they are shown read-only as mydisk_snap.
+ * Writing 0 removes the snapshot and gives the pages the disk still reads through to
+ * back to it.
+*****************************************************************************************/
+
+static DEFINE_MUTEX(mydisk_snap_lock);
+
+static struct
+{
+    struct request_queue *queue;
+    struct gendisk *gd;
+} snap;
+
+static blk_qc_t mydisk_snap_make_request(struct request_queue *q, struct bio *bio)
+{
+    sector_t sector = bio->bi_iter.bi_sector;
+    struct bvec_iter iter;
+    struct bio_vec bv;
+    u8 *buffer;
+
+    /* a snapshot is read-only */
+    if (bio_end_sector(bio) > device.size || bio_op(bio) != REQ_OP_READ)
+    {
+        bio->bi_status = BLK_STS_IOERR;
+        goto out;
+    }
+    bio_for_each_segment(bv, bio, iter)
+    {
+        buffer = kmap_atomic(bv.bv_page);
+        mydisk_read(buffer + bv.bv_offset, sector, bv.bv_len, true);
+        kunmap_atomic(buffer);
+        sector += bv.bv_len >> 9;
+    }
+out:
+    bio_endio(bio);
+    return BLK_QC_T_NONE;
+}
+
+/*
+ * Move the pages of base the disk still reads through to into its tree and
+ * free the others. Without memory for the tree a page just stays in base,
+ * where the disk finds it all the same.
+ */
+static void mydisk_merge_base(void)
+{
+    pgoff_t idx[FREE_BATCH], first = 0;
+    int nr, i;
+
+    do
+    {
+        nr = mydisk_gather(&device.base, first, ULONG_MAX, idx);
+        for (i = 0; i < nr; i++)
+        {
+            struct mydisk_stripe *st = mydisk_stripe(idx[i]);
+            void *entry, *top, *hidden = NULL;
+
+            if (radix_tree_preload(GFP_NOIO))
+                continue;
+            mydisk_stripe_lock(st);
+            spin_lock(&device.lock);
+            entry = radix_tree_delete(&device.base, idx[i]);
+            top = radix_tree_lookup(&device.pages, idx[i]);
+            if (!top)
+            {
+                radix_tree_insert(&device.pages, idx[i], entry);
+                entry = NULL;
+            }
+            else if (top == mydisk_fill_entry(0))
+            {
+                /* nothing left to hide */
+                hidden = radix_tree_delete(&device.pages, idx[i]);
+            }
+            spin_unlock(&device.lock);
+            mydisk_stripe_unlock(st);
+            radix_tree_preload_end();
+            mydisk_free_entry(entry);
+            mydisk_free_entry(hidden);
+        }
+        if (nr)
+            first = idx[nr - 1] + 1;
+        cond_resched();
+    } while (nr == FREE_BATCH);
+}
+
+static int mydisk_snap_create(void)
+{
+    int i;
+
+    /* leftovers of the last snapshot */
+    mydisk_merge_base();
+    if (!radix_tree_empty(&device.base))
+        return -ENOMEM;
+
+    snap.queue = blk_alloc_queue(GFP_KERNEL);
+    if (!snap.queue)
+        return -ENOMEM;
+    blk_queue_make_request(snap.queue, mydisk_snap_make_request);
+    blk_queue_logical_block_size(snap.queue, SECTOR_SIZE);
+    queue_flag_set_unlocked(QUEUE_FLAG_NONROT, snap.queue);
+    queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, snap.queue);
+
+    snap.gd = alloc_disk(mydisk_minors());
+    if (!snap.gd)
+    {
+        blk_cleanup_queue(snap.queue);
+        snap.queue = NULL;
+        return -ENOMEM;
+    }
+    snap.gd->major = c;
+    snap.gd->first_minor = mydisk_minors();
+    snap.gd->fops = &fops;
+    snap.gd->private_data = &device;
+    snap.gd->queue = snap.queue;
+    sprintf(snap.gd->disk_name, "mydisk_snap");
+    set_capacity(snap.gd, device.size);
+    set_disk_ro(snap.gd, 1);
+
+    /*
+     * Nothing in flight while the trees move, offloaded chunks and flushing
+     * bios included. The writeback reads the store outside the queue, it
+     * is held off by its lock, and any other lockless reader retries on the
+     * stripe seqcounts, as a half copied pair of roots shows both empty.
+     */
+    blk_mq_freeze_queue(device.queue);
+    flush_workqueue(mydisk_wq);
+    mutex_lock(&mydisk_wb_lock);
+    spin_lock(&device.lock);
+    for (i = 0; i < MYDISK_STRIPES; i++)
+        raw_write_seqcount_begin(&device.stripes[i].seq);
+    swap(device.pages, device.base);
+    for (i = 0; i < MYDISK_STRIPES; i++)
+        raw_write_seqcount_end(&device.stripes[i].seq);
+    spin_unlock(&device.lock);
+    mutex_unlock(&mydisk_wb_lock);
+    blk_mq_unfreeze_queue(device.queue);
+
+    add_disk(snap.gd);
+    return 0;
+}
+
+static int mydisk_snap_delete(void)
+{
+    struct block_device *bdev = bdget_disk(snap.gd, 0);
+    bool busy;
+
+    if (!bdev)
+        return -ENOMEM;
+    mutex_lock(&bdev->bd_mutex);
+    busy = bdev->bd_openers;
+    mutex_unlock(&bdev->bd_mutex);
+    bdput(bdev);
+    if (busy)
+        return -EBUSY;
+
+    del_gendisk(snap.gd);
+    blk_cleanup_queue(snap.queue);
+    put_disk(snap.gd);
+    snap.gd = NULL;
+    snap.queue = NULL;
+    mydisk_merge_base();
+    return 0;
+}
+
+static ssize_t snapshot_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return scnprintf(buf, PAGE_SIZE, "%d\n", snap.gd != NULL);
+}
+
+static ssize_t snapshot_store(struct device *dev, struct device_attribute *attr,
+                              const char *buf, size_t len)
+{
+    bool on;
+    int ret;
+
+    ret = kstrtobool(buf, &on);
+    if (ret)
+        return ret;
+    mutex_lock(&mydisk_snap_lock);
+    if (on && snap.gd)
+        ret = -EEXIST;
+    else if (on)
+        ret = mydisk_snap_create();
+    else if (snap.gd)
+        ret = mydisk_snap_delete();
+    mutex_unlock(&mydisk_snap_lock);
+    return ret ? ret : len;
+}
+static DEVICE_ATTR_RW(snapshot);
+
+static struct attribute *mydisk_attrs[] =
+{
+    &dev_attr_mm_stat.attr,
+    &dev_attr_snapshot.attr,
+    NULL,
+};
+
+static const struct attribute_group mydisk_attr_group =
+{
+    .attrs = mydisk_attrs,
+};
+
+static int mydisk_alloc_queue(void)
+{
+    int ret;
+
+    /* chunks of offloaded writes, bound to the CPU they are queued on, and flushing bios */
+    mydisk_wq = alloc_workqueue("mydisk", WQ_MEM_RECLAIM | WQ_HIGHPRI | WQ_CPU_INTENSIVE, 0);
+    if (!mydisk_wq)
+        return -ENOMEM;
+
+    if (queue_mode == MYDISK_Q_BIO)
+    {
+        device.queue = blk_alloc_queue(GFP_KERNEL);
+        if (!device.queue)
+        {
+            destroy_workqueue(mydisk_wq);
+            return -ENOMEM;
+        }
+        blk_queue_make_request(device.queue, mydisk_make_request);
+        printk(KERN_INFO "mydisk: bio based queue");
+        return 0;
+    }
+
+    device.tag_set.ops = io_poll ? &mydisk_poll_mq_ops : &mydisk_mq_ops;
+    device.tag_set.nr_hw_queues = nr_hw_queues > 0 ? nr_hw_queues : num_online_cpus();
+    device.tag_set.queue_depth = hw_queue_depth;
+    device.tag_set.numa_node = numa_node;
+    device.tag_set.cmd_size = sizeof(struct mydisk_io);
+    /* pages of the store are allocated in queue_rq(), which may sleep */
+    device.tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+    ret = blk_mq_alloc_tag_set(&device.tag_set);
+    if (ret)
+    {
+        destroy_workqueue(mydisk_wq);
+        return ret;
+    }
+
+    device.queue = blk_mq_init_queue(&device.tag_set);
+    if (IS_ERR(device.queue))
+    {
+        blk_mq_free_tag_set(&device.tag_set);
+        destroy_workqueue(mydisk_wq);
+        return PTR_ERR(device.queue);
+    }
+    if (io_poll)
+        queue_flag_set_unlocked(QUEUE_FLAG_POLL, device.queue);
+    printk(KERN_INFO "mydisk: %u hardware queues, depth %u",
+           device.tag_set.nr_hw_queues, device.tag_set.queue_depth);
+    return 0;
+}
+
+static void mydisk_free_queue(void)
+{
+    blk_cleanup_queue(device.queue);
+    if (queue_mode != MYDISK_Q_BIO)
+        blk_mq_free_tag_set(&device.tag_set);
+    destroy_workqueue(mydisk_wq);
+}
+
+int device_setup(void)
+{
+    int ret;
+
+    ret = mydisk_init();
+    if (ret)
+        return ret;
+    printk(KERN_INFO"THIS IS DEVICE SIZE %llu",(unsigned long long)device.size);	
+
+    c = register_blkdev(c, "mydisk");// major no. allocation
+    if (c < 0)
+    {
+        ret = c;
+        goto out_free;
+    }
+    printk(KERN_ALERT "Major Number is : %d",c);
+
+    /* bio mode ends bios in the submitter, there is nothing to poll for */
+    if ((queue_mode != MYDISK_Q_BIO && queue_mode != MYDISK_Q_MQ) ||
+        (io_poll && queue_mode != MYDISK_Q_MQ))
+    {
+        ret = -EINVAL;
+        goto out_unregister;
+    }
+    ret = mydisk_alloc_queue();
+    if (ret)
+        goto out_unregister;
+    blk_queue_logical_block_size(device.queue, SECTOR_SIZE);
+    /* let 1 MiB writes arrive whole, so offloading has something to split */
+    blk_queue_max_hw_sectors(device.queue, 2048);
+    blk_queue_max_segments(device.queue, 512);
+    /* discards free memory, zeroes are a discard too */
+    device.queue->limits.discard_granularity = PAGE_SIZE;
+    blk_queue_max_discard_sectors(device.queue, UINT_MAX);
+    blk_queue_max_write_zeroes_sectors(device.queue, UINT_MAX);
+    queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, device.queue);
+    queue_flag_set_unlocked(QUEUE_FLAG_NONROT, device.queue);
+    queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, device.queue);
+    /* the image lags behind the store, a flush writes it back */
+    if (mydisk_file)
+        blk_queue_write_cache(device.queue, true, false);
+
+    device.gd = alloc_disk(mydisk_minors()); // gendisk allocation
+    if (!device.gd)
+    {
+        ret = -ENOMEM;
+        goto out_queue;
+    }
+    
+    (device.gd)->major=c; // major no to gendisk
+    device.gd->first_minor=0; // first minor of gendisk
+
+    device.gd->fops = &fops;
+    device.gd->private_data = &device;
+    device.gd->queue = device.queue;
+    sprintf(((device.gd)->disk_name), "mydisk");
+    set_capacity(device.gd, device.size);  
+    add_disk(device.gd);
+    if (sysfs_create_group(&disk_to_dev(device.gd)->kobj, &mydisk_attr_group))
+        printk(KERN_WARNING "mydisk: no mm_stat and snapshot in sysfs\n");
+    return 0;
+
+out_queue:
+    mydisk_free_queue();
+out_unregister:
+    unregister_blkdev(c, "mydisk");
+out_free:
+    mydisk_file_close();
+    mydisk_free_pages();
+    mydisk_zexit();
+    return ret;
+}
+
+static int __init mydiskdrive_init(void)
+{	
+    return device_setup();
+}
+
+void mydisk_cleanup(void)
+{
+    /* written back while the store is still there */
+    mydisk_file_close();
+    mydisk_free_pages();
+    mydisk_zexit();
+}
+
+void __exit mydiskdrive_exit(void)
+{
+    sysfs_remove_group(&disk_to_dev(device.gd)->kobj, &mydisk_attr_group);
+    if (snap.gd)
+    {
+        /* its pages go with the rest of the store */
+        del_gendisk(snap.gd);
+        blk_cleanup_queue(snap.queue);
+        put_disk(snap.gd);
+    }
     del_gendisk(device.gd);
     put_disk(device.gd);
-    blk_cleanup_queue(device.queue);
+    mydisk_free_queue();
     unregister_blkdev(c, "mydisk");
     mydisk_cleanup();	
 }
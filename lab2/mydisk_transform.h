@@ -0,0 +1,139 @@
+/*
+ * Write transform of mydisk shared by the driver and bench/transform.c.
+ *
+ * A written byte that differs from the byte already on the disk is replaced
+ * by the rounded average of the three bytes before it, taken after they went
+ * through the transform themselves. The first three bytes of a segment are
+ * kept as is.
+ *
+ * mydisk_transform_bytes() is the reference loop. mydisk_transform_swar()
+ * gives the same result eight bytes at a time where the dependency allows:
+ * equal bytes are skipped a word at a time, and once three output bytes in a
+ * row are equal the average stays at that value, so a run of changed bytes
+ * collapses into a fill.
+ */
+#ifndef MYDISK_TRANSFORM_H
+#define MYDISK_TRANSFORM_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#define MT_ONES  0x0101010101010101ULL
+#define MT_HIGHS 0x8080808080808080ULL
+#define MT_LOWS  0x7f7f7f7f7f7f7f7fULL
+
+static inline unsigned char mt_avg3(unsigned int a, unsigned int b, unsigned int c)
+{
+    /* DIV_ROUND_CLOSEST(a + b + c, 3) */
+    return (a + b + c + 1) / 3;
+}
+
+/* Bytes [from, to) of buf, old holds the disk contents under buf + from */
+static inline void mydisk_transform_bytes(unsigned char *buf, const unsigned char *old,
+                                          size_t from, size_t to)
+{
+    size_t i;
+
+    for (i = from < 3 ? 3 : from; i < to; i++) {
+        if (old[i - from] != buf[i])
+            buf[i] = mt_avg3(buf[i - 3], buf[i - 2], buf[i - 1]);
+    }
+}
+
+/* high bit of a lane is set iff that byte of x is zero */
+static inline uint64_t mt_zero_bytes(uint64_t x)
+{
+    return ~(((x & MT_LOWS) + MT_LOWS) | x) & MT_HIGHS;
+}
+
+static inline void mydisk_transform_swar(unsigned char *buf, const unsigned char *old,
+                                         size_t from, size_t to)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    size_t i = from < 3 ? 3 : from;
+    unsigned char a, b, c;
+
+    if (i >= to)
+        return;
+    a = buf[i - 3];
+    b = buf[i - 2];
+    c = buf[i - 1];
+
+    while (i < to) {
+        size_t end = to;
+
+        if (to - i >= 8) {
+            uint64_t w, o, x;
+            size_t n;
+
+            __builtin_memcpy(&w, buf + i, 8);
+            __builtin_memcpy(&o, old + i - from, 8);
+            x = w ^ o;
+            /* leading equal bytes stay, the window is whatever they are */
+            if (!x) {
+                do {
+                    i += 8;
+                    if (to - i < 8)
+                        break;
+                    __builtin_memcpy(&w, buf + i, 8);
+                    __builtin_memcpy(&o, old + i - from, 8);
+                } while (w == o);
+                n = 0;
+            } else {
+                n = __builtin_ctzll(x) >> 3;
+                i += n;
+            }
+            if (!x || n) {
+                a = buf[i - 3];
+                b = buf[i - 2];
+                c = buf[i - 1];
+                continue;
+            }
+            if (a == b && b == c) {
+                /* every byte becomes a, except equal bytes holding another value */
+                const uint64_t fill = MT_ONES * a;
+                uint64_t keep, mask;
+
+                for (;;) {
+                    keep = mt_zero_bytes(x) & ~mt_zero_bytes(w ^ fill);
+                    if (keep)
+                        break;
+                    __builtin_memcpy(buf + i, &fill, 8);
+                    i += 8;
+                    if (to - i < 8)
+                        break;
+                    __builtin_memcpy(&w, buf + i, 8);
+                    __builtin_memcpy(&o, old + i - from, 8);
+                    x = w ^ o;
+                }
+                if (keep) {
+                    n = __builtin_ctzll(keep) >> 3;
+                    mask = (1ULL << (n * 8)) - 1;
+                    w = (fill & mask) | (w & ~mask);
+                    __builtin_memcpy(buf + i, &w, 8);
+                    i += n;
+                }
+                if (!keep || n)
+                    continue;
+            }
+            /* nothing to batch, take this word a byte at a time */
+            end = i + 8;
+        }
+        for (; i < end; i++) {
+            if (old[i - from] != buf[i])
+                buf[i] = mt_avg3(a, b, c);
+            a = b;
+            b = c;
+            c = buf[i];
+        }
+    }
+#else
+    mydisk_transform_bytes(buf, old, from, to);
+#endif
+}
+
+#endif /* MYDISK_TRANSFORM_H */
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Sequential 1M write and read bandwidth for every placement of the store:
+# wherever the allocator puts it, bound to each online node in turn, and
+# interleaved over all of them, each with 4K and with 2 MiB compound pages.
+# fio runs on the CPUs of node CPU_NODE (default 0), so binding the store to
+# another node shows the cost of remote memory. Needs numactl. Run from the
+# directory with lab2.ko, extra module parameters are passed on.
+# Usage: ./numabench.sh [module params...], default disk_size_mb=2048 write_transform=0
+if [ "$(whoami)" != "root" ]; then
+  sudo "$0" "$@"
+  exit $?
+fi
+
+DEV=/dev/mydisk
+CPU_NODE=${CPU_NODE:-0}
+RUNTIME=${RUNTIME:-10}
+PARAMS=("$@")
+[ ${#PARAMS[@]} -eq 0 ] && PARAMS=(disk_size_mb=2048 write_transform=0)
+
+PLACEMENTS=("numa_node=-1")
+for node in /sys/devices/system/node/node[0-9]*; do
+  PLACEMENTS+=("numa_node=${node##*node}")
+done
+PLACEMENTS+=("numa_interleave=1")
+
+for placement in "${PLACEMENTS[@]}"; do
+  for huge in 0 1; do
+    rmmod lab2 2>/dev/null
+    insmod lab2.ko $placement huge_pages=$huge "${PARAMS[@]}" || exit 1
+    udevadm settle
+    echo "$placement huge_pages=$huge cpus of node $CPU_NODE"
+    for rw in write read; do
+      numactl --cpunodebind="$CPU_NODE" --membind="$CPU_NODE" \
+        fio --name=$rw --filename=$DEV --rw=$rw --bs=1M --direct=1 \
+            --ioengine=libaio --iodepth=4 --time_based --runtime="$RUNTIME" |
+        grep -E "IOPS="
+    done
+  done
+done
+rmmod lab2
@@ -0,0 +1,34 @@
+#!/bin/bash
+# 4K random read latency, one job at queue depth 1, as p50/p99/p99.9 of the
+# completion latency in three setups: completions ended in queue_rq()
+# (io_poll=0), posted and completed by the emulated interrupt (io_poll=1
+# without hipri), and reaped by polling (io_poll=1 with RWF_HIPRI). The
+# engine is pvsync2 by default; on kernels with io_uring ENGINE=io_uring
+# makes --hipri set up the ring with IORING_SETUP_IOPOLL. Run from the
+# directory with lab2.ko, extra module parameters are passed on.
+# Usage: ./pollbench.sh [module params...], e.g. ./pollbench.sh poll_irq_us=5
+if [ "$(whoami)" != "root" ]; then
+  sudo "$0" "$@"
+  exit $?
+fi
+
+DEV=/dev/mydisk
+ENGINE=${ENGINE:-pvsync2}
+RUNTIME=${RUNTIME:-10}
+PARAMS=("$@")
+
+for setup in "0 0" "1 0" "1 1"; do
+  read -r io_poll hipri <<< "$setup"
+  rmmod lab2 2>/dev/null
+  insmod lab2.ko io_poll=$io_poll "${PARAMS[@]}" || exit 1
+  udevadm settle
+  # reads of holes never touch the store, fill the disk first
+  fio --name=fill --filename=$DEV --rw=write --bs=1M --direct=1 \
+      --ioengine=libaio --iodepth=4 > /dev/null
+  echo "io_poll=$io_poll hipri=$hipri"
+  fio --name=lat --filename=$DEV --rw=randread --bs=4k --direct=1 \
+      --ioengine="$ENGINE" --hipri=$hipri --iodepth=1 --numjobs=1 \
+      --time_based --runtime="$RUNTIME" --percentile_list=50:99:99.9 |
+    grep -E "IOPS=|th=\["
+done
+rmmod lab2
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Plain store against compress=1: fill the whole disk with incompressible and
+# with 75% compressible data, read it back, and print the bandwidth together
+# with /sys/block/mydisk/mm_stat after the fill. Run from the directory with
+# lab2.ko, extra module parameters are passed on.
+# Usage: ./zbench.sh [module params...], e.g. ./zbench.sh write_transform=0
+if [ "$(whoami)" != "root" ]; then
+  sudo "$0" "$@"
+  exit $?
+fi
+
+DEV=/dev/mydisk
+
+for compress in 0 1; do
+  for pct in 0 75; do
+    rmmod lab2 2>/dev/null
+    insmod lab2.ko compress=$compress "$@" || exit 1
+    udevadm settle
+    echo "compress=$compress buffer_compress_percentage=$pct"
+    fio --name=fill --filename=$DEV --rw=write --bs=1M --direct=1 \
+        --ioengine=libaio --iodepth=4 --buffer_compress_percentage=$pct \
+        --buffer_compress_chunk=4k --refill_buffers | grep -E "IOPS="
+    echo "mm_stat: $(cat /sys/block/mydisk/mm_stat)"
+    for rw in read randread; do
+      fio --name=$rw --filename=$DEV --rw=$rw --bs=4k --direct=1 \
+          --ioengine=libaio --iodepth=32 --numjobs="$(nproc)" --group_reporting \
+          --time_based --runtime=10 | grep -E "IOPS="
+    done
+  done
+done
+rmmod lab2